@@ -14,14 +14,29 @@
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE
 #include<stdio.h>
 #include<stdlib.h>
 #include<string.h>
 #include<math.h>
+#include<time.h>
+#include<unistd.h>
+#include<sys/stat.h>
+#include<sys/syscall.h>
+#include<sys/mman.h>
+#include<sched.h>
+#include<pthread.h>
+#include<stdatomic.h>
+#include<signal.h>
+#include<sys/wait.h>
+#include<sys/socket.h>
+#include<netinet/in.h>
+#include<errno.h>
 
 #include<CL/cl.h>
 
 #include "test/opencl_gpu_helper.h"
+#include "test/opencl_queue_wrapper.h"
 
 #ifdef GOFAST
 #include<omp.h>
@@ -30,26 +45,101 @@
 
 int DIM, NLAYER, NHEAD;
 
-int token_processed_upto;
 int num_total_tokens;
-int tmp,zz;
+__thread int tmp;  // per thread, as NewMatrix sets it (see GPT2_STAGES)
+int zz;
 char* bpe;
 
-void *memory, *memory_top;
+__thread void* memory;  // each pipeline stage has its own arena
+void* memory_top;
+size_t g_matrix_align = 64;
 FILE* fp;
 
+// Entry (i, j) is at dat[i*row_stride + j*col_stride]. Matrices from
+// NewMatrix are dense (row_stride = cols, col_stride = 1); other strides make
+// a view of someone else's data, e.g. a transposed view just swaps them.
 typedef struct {
   float* dat;
   int rows, cols;
+  int row_stride, col_stride;
 } Matrix;
 
-Matrix* layer_weights;
+#define AT(a, i, j) (a).dat[(size_t)(i)*(a).row_stride + (size_t)(j)*(a).col_stride]
+#define is_dense(a) (((a).rows < 2 || (a).row_stride == (a).cols) && ((a).cols < 2 || (a).col_stride == 1))
+// Where the i-th entry in row-major order lives
+#define IDX(a, i) (is_dense(a) ? (i) : (i)/(a).cols*(a).row_stride + (i)%(a).cols*(a).col_stride)
+
+__thread Matrix* layer_weights;
 
 cl_context g_cl_context;
 cl_command_queue g_cl_queue;
+cl_command_queue g_cl_upload_queue;  // weight copies, next to the kernels (see cl_weight_buffer)
+cl_ulong g_cl_mem_size;
 cl_program g_cl_program;
-cl_kernel g_cl_kernel_matmul_a_bt;
 cl_device_id g_cl_device;
+size_t g_cl_host_align;  // nonzero when buffers wrap host memory, see cl_host_buffer
+
+// The matmul kernel variants in matrix_kernels.cl (see cl_matmul_setup)
+enum { MATMUL_NAIVE, MATMUL_TILED, MATMUL_REDUCE, MATMUL_VARIANTS };
+
+// The variant and work-group size to use for one shape class
+typedef struct {
+  int m, n, k;  // m is the row bucket, see cl_tune_bucket
+  int variant;
+  int local[2];
+} cl_tune_t;
+
+// The elementwise ops a matmul kernel applies to each output as it is
+// produced (matmul_epilogue in matrix_kernels.cl), see epilogue_t
+typedef struct {
+  cl_mem bias, residual;  // either may be NULL
+  cl_uint gelu;
+  float scale;            // 0 for none
+} cl_epilogue_t;
+
+#define MAX_TUNE 64
+// One program's matmul kernels and the tuning profile of its device
+typedef struct {
+  cl_kernel kernels[MATMUL_VARIANTS];
+  size_t max_group;  // largest work-group all the variants accept
+  cl_ulong local_mem;
+  cl_tune_t tune[MAX_TUNE];
+  int num_tune;
+} cl_matmul_t;
+
+cl_matmul_t g_cl_matmul;
+
+// One device's share of the device-resident forward pass (see cl_pipeline_forward)
+typedef struct {
+  cl_context context;
+  cl_device_id device;
+  cl_command_queue queue;
+  cl_program program;
+  cl_kernel embed, layernorm, fused, attention, topk;
+  cl_matmul_t matmul;
+  cl_mem *weights;        // this shard's slice of every weight matrix
+  int num_weights;
+  cl_mem wpe, wte, tokens;
+  cl_mem line, ln, qkv, attn, hidden, proj, last, logits;
+  cl_mem top_vals[2], top_ids[2];  // each group's top k of the logits, then the shard's
+  int head0, heads;       // the attention heads this shard owns
+  int hidden0, hiddens;   // the MLP hidden units this shard owns
+  int vocab0, vocab;      // the rows of wte (logits) this shard owns
+  float *host;            // staging for reading back partial sums
+  size_t host_align;      // as g_cl_host_align, for this shard's device
+  cl_event tail;
+  cl_int err;  // first failed enqueue of the current pass
+} cl_pipeline_t;
+
+#define MAX_SHARDS 16
+cl_pipeline_t g_cl_shards[MAX_SHARDS];
+int g_cl_num_shards;
+int g_cl_pipeline_ready;
+float* g_cl_stage;  // host-side sums and embeddings sent to every shard
+
+// The topk kernel and its buffers on the plain device (see cl_logits_topk)
+cl_kernel g_cl_topk;
+cl_mem g_cl_top_vals[2], g_cl_top_ids[2];
 
 char* load_kernel_source(const char* filename, size_t* size) {
   FILE *fp = fopen(filename, "r");
@@ -76,81 +166,799 @@ char* load_kernel_source(const char* filename, size_t* size) {
   return source;
 }
 
+// Built programs are cached on disk (GPT2_CL_CACHE, default .cl_cache/) because
+// clBuildProgram from source is slow on some drivers. The file name is a hash
+// of everything that can change the binary: platform, device, driver, build
+// options and the kernel source itself.
+unsigned long long fnv1a(unsigned long long h, const void* data, size_t n) {
+  const unsigned char *p = data;
+  for (size_t i = 0; i < n; i++) h = (h ^ p[i]) * 1099511628211ULL;
+  return h;
+}
+
+// Hash of the platform, device and driver, or 0 if the driver won't tell.
+unsigned long long cl_device_hash(cl_device_id device) {
+  cl_platform_id platform;
+  if (clGetDeviceInfo(device, CL_DEVICE_PLATFORM, sizeof(platform), &platform, NULL) != CL_SUCCESS) return 0;
+
+  char info[1024];
+  unsigned long long h = 14695981039346656037ULL;
+  cl_platform_info platform_keys[] = {CL_PLATFORM_NAME, CL_PLATFORM_VERSION};
+  cl_device_info device_keys[] = {CL_DEVICE_NAME, CL_DEVICE_VERSION, CL_DRIVER_VERSION};
+  for (int i = 0; i < 2; i++) {
+    size_t len = 0;
+    if (clGetPlatformInfo(platform, platform_keys[i], sizeof(info), info, &len) != CL_SUCCESS) return 0;
+    h = fnv1a(h, info, len);
+  }
+  for (int i = 0; i < 3; i++) {
+    size_t len = 0;
+    if (clGetDeviceInfo(device, device_keys[i], sizeof(info), info, &len) != CL_SUCCESS) return 0;
+    h = fnv1a(h, info, len);
+  }
+  return h;
+}
+
+int cl_cache_path(cl_device_id device, const char* options, const char* source, size_t source_size, char* path, size_t n) {
+  const char *dir = getenv("GPT2_CL_CACHE");
+  if (!dir) dir = ".cl_cache";
+  if (!*dir) return -1;  // GPT2_CL_CACHE= turns the cache off
+
+  unsigned long long h = cl_device_hash(device);
+  if (!h) return -1;
+  if (options) h = fnv1a(h, options, strlen(options) + 1);
+  h = fnv1a(h, source, source_size);
+
+  mkdir(dir, 0755);
+  snprintf(path, n, "%s/%016llx.bin", dir, h);
+  return 0;
+}
+
+cl_program load_cached_program(cl_context context, cl_device_id device, const char* path, const char* options) {
+  size_t size;
+  unsigned char *binary = (unsigned char*)load_kernel_source(path, &size);
+  if (!binary) return NULL;
+
+  cl_int err, status;
+  cl_program program = clCreateProgramWithBinary(context, 1, &device, &size, (const unsigned char**)&binary, &status, &err);
+  free(binary);
+  if (err != CL_SUCCESS || status != CL_SUCCESS) return NULL;
+
+  // Binaries still have to be "built", which is cheap, but can fail if the driver rejects them
+  if (clBuildProgram(program, 1, &device, options, NULL, NULL) != CL_SUCCESS) {
+    clReleaseProgram(program);
+    return NULL;
+  }
+  return program;
+}
+
+void save_cached_program(cl_program program, const char* path) {
+  size_t size;
+  if (clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES, sizeof(size), &size, NULL) != CL_SUCCESS || !size) return;
+  unsigned char *binary = malloc(size);
+  if (!binary) return;
+
+  if (clGetProgramInfo(program, CL_PROGRAM_BINARIES, sizeof(binary), &binary, NULL) == CL_SUCCESS) {
+    // Write then rename, so a chat process starting at the same time never reads half a file
+    char tmp_path[1100];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%d", path, (int)getpid());
+    FILE *out = fopen(tmp_path, "wb");
+    if (out) {
+      int ok = fwrite(binary, 1, size, out) == size;
+      ok &= fclose(out) == 0;
+      if (!ok || rename(tmp_path, path)) remove(tmp_path);
+    }
+  }
+  free(binary);
+}
+
+// Build test/matrix_kernels.cl for one device. Returns NULL on failure.
+cl_program build_program(cl_context context, cl_device_id device, const char* options) {
+  cl_int err;
+  size_t source_size;
+  char *source = load_kernel_source("test/matrix_kernels.cl", &source_size);
+  if (!source) return NULL;
+
+  char path[1024];
+  int cached = cl_cache_path(device, options, source, source_size, path, sizeof(path)) == 0;
+  if (cached) {
+    cl_program program = load_cached_program(context, device, path, options);
+    if (program) {
+      free(source);
+      return program;
+    }
+  }
+
+  cl_program program = clCreateProgramWithSource(context, 1, (const char**)&source, &source_size, &err);
+  free(source);
+  if (err != CL_SUCCESS) return NULL;
+
+  err = clBuildProgram(program, 1, &device, options, NULL, NULL);
+  if (err != CL_SUCCESS) {
+    clReleaseProgram(program);
+    return NULL;
+  }
+  if (cached) save_cached_program(program, path);
+  return program;
+}
+
+// Round n up to a multiple of m so that global sizes divide the work-group size.
+size_t cl_round_up(size_t n, size_t m) {
+  return (n + m - 1) / m * m;
+}
+
+// Matmul kernel variants and per-device tuning profiles.
+// matrix_kernels.cl has three interchangeable kernels for C = A * B_T^T + bias:
+// the naive one (one work-item per output, any 2D work-group), a tiled one
+// (square work-groups that stage tiles of A and B_T in local memory) and a
+// reduce one (a 1 x L work-group per output that splits the dot product over
+// K, which is what single-row decode shapes want). Which is fastest, and with
+// which work-group, depends on the device and the shape, so
+//   ./a.out --tune gpt2-124M.ckpt
+// times them all on the model's shapes (see cl_tune_run) and writes the
+// winners to a profile under GPT2_CL_TUNE (default .cl_tune/), one file per
+// device. Every program loads its device's profile when it is set up; shapes
+// the profile has no entry for get the defaults in cl_tune_lookup.
+const char* g_matmul_kernel_names[] = {"matmul_a_bt_bias", "matmul_a_bt_tiled", "matmul_a_bt_reduce"};
+const char* g_matmul_variant_names[] = {"naive", "tiled", "reduce"};
+
+// Shape classes differ by the number of rows: decode, short and long inputs
+int cl_tune_bucket(int m) {
+  return m <= 1 ? 1 : m <= 32 ? 32 : 256;
+}
+
+int cl_tune_path(cl_device_id device, char* path, size_t n) {
+  const char *dir = getenv("GPT2_CL_TUNE");
+  if (!dir) dir = ".cl_tune";
+  unsigned long long h = cl_device_hash(device);
+  if (!*dir || !h) return -1;
+  snprintf(path, n, "%s/%016llx.txt", dir, h);
+  return 0;
+}
+
+// The profile is one "m n k variant lx ly" line per shape class; lines that
+// don't parse (like the '#' header) are skipped.
+void cl_tune_load(cl_matmul_t* mm, cl_device_id device) {
+  char path[1024], line[256], name[32];
+  if (cl_tune_path(device, path, sizeof(path))) return;
+  FILE *in = fopen(path, "r");
+  if (!in) return;
+
+  while (mm->num_tune < MAX_TUNE && fgets(line, sizeof(line), in)) {
+    cl_tune_t t;
+    if (sscanf(line, "%d %d %d %31s %d %d", &t.m, &t.n, &t.k, name, &t.local[0], &t.local[1]) != 6) continue;
+    for (t.variant = 0; t.variant < MATMUL_VARIANTS && strcmp(name, g_matmul_variant_names[t.variant]); t.variant++);
+    if (t.variant < MATMUL_VARIANTS) mm->tune[mm->num_tune++] = t;
+  }
+  fclose(in);
+}
+
+// Create the variants out of program and load the device's profile. Returns 0 on success.
+int cl_matmul_init(cl_matmul_t* mm, cl_program program, cl_device_id device) {
+  cl_int err;
+  if (clGetDeviceInfo(device, CL_DEVICE_MAX_WORK_GROUP_SIZE, sizeof(mm->max_group), &mm->max_group, NULL) != CL_SUCCESS ||
+      clGetDeviceInfo(device, CL_DEVICE_LOCAL_MEM_SIZE, sizeof(mm->local_mem), &mm->local_mem, NULL) != CL_SUCCESS) {
+    return -1;
+  }
+  for (int i = 0; i < MATMUL_VARIANTS; i++) {
+    mm->kernels[i] = clCreateKernel(program, g_matmul_kernel_names[i], &err);
+    if (err != CL_SUCCESS) return -1;
+    size_t kernel_max;
+    if (clGetKernelWorkGroupInfo(mm->kernels[i], device, CL_KERNEL_WORK_GROUP_SIZE, sizeof(kernel_max), &kernel_max, NULL) == CL_SUCCESS &&
+        kernel_max < mm->max_group) {
+      mm->max_group = kernel_max;
+    }
+  }
+  mm->num_tune = 0;
+  cl_tune_load(mm, device);
+  return 0;
+}
+
+void cl_matmul_release(cl_matmul_t* mm) {
+  for (int i = 0; i < MATMUL_VARIANTS; i++) {
+    if (mm->kernels[i]) clReleaseKernel(mm->kernels[i]);
+  }
+  memset(mm, 0, sizeof(*mm));
+}
+
+// Whether the device can run this variant with this work-group at all
+int cl_tune_fits(const cl_matmul_t* mm, cl_tune_t t) {
+  size_t group = (size_t)t.local[0] * t.local[1];
+  size_t local_floats = t.variant == MATMUL_TILED ? 2 * group : t.variant == MATMUL_REDUCE ? group : 0;
+  if (t.local[0] < 1 || t.local[1] < 1 || group > mm->max_group || local_floats * sizeof(float) > mm->local_mem) return 0;
+  if (t.variant == MATMUL_TILED) return t.local[0] == t.local[1];
+  if (t.variant == MATMUL_REDUCE) return t.local[0] == 1 && !(t.local[1] & (t.local[1] - 1));
+  return 1;
+}
+
+// The profile entry for this shape: the one with the same row bucket and K
+// and the nearest N (shards see slices of the tuned widths). Without one,
+// single rows use the reduce variant and everything else the naive one on
+// 16 x 16 work-groups.
+cl_tune_t cl_tune_lookup(const cl_matmul_t* mm, int M, int N, int K) {
+  int m = cl_tune_bucket(M);
+  const cl_tune_t* best = NULL;
+  for (int i = 0; i < mm->num_tune; i++) {
+    const cl_tune_t* t = mm->tune + i;
+    if (t->m == m && t->k == K && (!best || abs(t->n - N) < abs(best->n - N))) best = t;
+  }
+  if (best && cl_tune_fits(mm, *best)) return *best;
+
+  cl_tune_t t = {m, N, K, MATMUL_REDUCE, {1, 64}};
+  if (M > 1 || !cl_tune_fits(mm, t)) {
+    t.variant = MATMUL_NAIVE;
+    t.local[0] = M < 16 ? 1 : 16;
+    t.local[1] = 16;
+    while ((size_t)t.local[0] * t.local[1] > mm->max_group) t.local[t.local[0] > 1 ? 0 : 1] /= 2;
+  }
+  return t;
+}
+
+// Set the arguments of variant t for out = e(a * b^T) (e may be NULL for the
+// plain product) and work out its NDRange. Returns the kernel to enqueue.
+cl_kernel cl_matmul_args(const cl_matmul_t* mm, cl_tune_t t, cl_mem a, cl_mem b, cl_mem out, const cl_epilogue_t* e,
+                         cl_uint M, cl_uint N, cl_uint K, size_t* global, size_t* local) {
+  cl_kernel kernel = mm->kernels[t.variant];
+  cl_epilogue_t none = {NULL, NULL, 0, 0};
+  if (!e) e = &none;
+  cl_mem bufs[] = {a, b, e->bias, out};
+  for (int i = 0; i < 4; i++) clSetKernelArg(kernel, i, sizeof(cl_mem), &bufs[i]);
+  clSetKernelArg(kernel, 4, sizeof(cl_uint), &M);
+  clSetKernelArg(kernel, 5, sizeof(cl_uint), &N);
+  clSetKernelArg(kernel, 6, sizeof(cl_uint), &K);
+  clSetKernelArg(kernel, 7, sizeof(cl_mem), &e->residual);
+  clSetKernelArg(kernel, 8, sizeof(cl_uint), &e->gelu);
+  clSetKernelArg(kernel, 9, sizeof(float), &e->scale);
+
+  local[0] = t.local[0];
+  local[1] = t.local[1];
+  size_t scratch = local[0] * local[1] * sizeof(float);
+  if (t.variant == MATMUL_TILED) {
+    clSetKernelArg(kernel, 10, scratch, NULL);
+    clSetKernelArg(kernel, 11, scratch, NULL);
+  } else if (t.variant == MATMUL_REDUCE) {
+    clSetKernelArg(kernel, 10, scratch, NULL);
+  }
+  global[0] = cl_round_up(M, local[0]);
+  global[1] = t.variant == MATMUL_REDUCE ? (size_t)N * local[1] : cl_round_up(N, local[1]);
+  return kernel;
+}
+
+// The same with the variant the profile picks for this shape
+cl_kernel cl_matmul_setup(const cl_matmul_t* mm, cl_mem a, cl_mem b, cl_mem out, const cl_epilogue_t* e,
+                          cl_uint M, cl_uint N, cl_uint K, size_t* global, size_t* local) {
+  return cl_matmul_args(mm, cl_tune_lookup(mm, M, N, K), a, b, out, e, M, N, K, global, local);
+}
+
+// Zero copy. Integrated GPUs (like the gfx701 APU) and CPU runtimes such as
+// pocl share memory with the host, so there is no point in copying matrices
+// into device buffers and back. On such devices (CL_DEVICE_HOST_UNIFIED_MEMORY,
+// or GPT2_CL_ZERO_COPY=1 to force it, =0 to turn it off) buffers are created
+// over the host arrays with CL_MEM_USE_HOST_PTR, results are made visible by
+// mapping them, and the arena is allocated so that every matrix in it starts
+// on the device's CL_DEVICE_MEM_BASE_ADDR_ALIGN boundary. Returns that
+// alignment in bytes, or 0 to copy as usual.
+size_t cl_host_align(const gpu_device_info_t* info) {
+  char *zero_copy = getenv("GPT2_CL_ZERO_COPY");
+  if (zero_copy ? !atoi(zero_copy) : !info->host_unified_memory) return 0;
+  size_t align = info->mem_base_addr_align / 8;
+  return align < 64 ? 64 : align;
+}
+
+int cl_host_aligned(size_t align, const void* host) {
+  return align && (size_t)host % align == 0;
+}
+
+// A buffer with the contents of host: host itself when the device shares
+// memory with it (and host is aligned the way it wants), otherwise a copy.
+// host must then outlive the buffer.
+cl_mem cl_host_buffer(cl_context context, size_t align, cl_mem_flags flags, void* host, size_t bytes, cl_int* err) {
+  flags |= cl_host_aligned(align, host) ? CL_MEM_USE_HOST_PTR : CL_MEM_COPY_HOST_PTR;
+  return clCreateBuffer(context, flags, bytes, host, err);
+}
+
+// Device memory budget. On a device that does not share memory with the
+// host, the weights used by the per-call matmuls have to be copied over, and
+// small devices (the gfx701 has 1 GB) cannot hold all of a large model. So
+// each weight gets a device buffer that stays there, as long as they fit in
+// GPT2_CL_BUDGET MB (default 3/4 of the device memory, leaving room for the
+// activations). wte is placed first; after that a weight that does not fit
+// takes the place of the resident one used least (least recently, on ties),
+// but only if it has been used more, so weights that are all used once per
+// token settle down instead of pushing each other out. The others are copied
+// into one of two staging buffers on a second queue: while a kernel reads
+// one, the weight that came after it last time is already being copied
+// into the other. Hit rates and bytes copied are reported on stderr.
+#define MAX_CL_WEIGHTS 1024
+typedef struct {
+  float* host;
+  size_t bytes;
+  cl_mem buf;           // NULL while it is not resident
+  cl_event uploaded;    // its copy into buf is done
+  unsigned long uses, last_use;
+  int next;             // the weight used after this one last time, or -1
+} cl_weight_t;
+
+typedef struct {
+  cl_mem buf;
+  int weight;           // the weight copied into it, or -1
+  cl_event uploaded;    // that copy is done
+  cl_event used;        // the last kernel that read it is done
+} cl_staging_t;
+
+cl_weight_t g_cl_weights[MAX_CL_WEIGHTS];
+int g_cl_num_weights, g_cl_last_weight = -1, g_cl_next_staging;
+size_t g_cl_budget, g_cl_resident_bytes;
+cl_staging_t g_cl_staging[2];
+unsigned long g_cl_weight_clock, g_cl_tokens, g_cl_resident_hits, g_cl_prefetch_hits, g_cl_weight_misses;
+double g_cl_upload_bytes;
+
+void cl_weights_report() {
+  unsigned long total = g_cl_resident_hits + g_cl_prefetch_hits + g_cl_weight_misses;
+  if (!total || !g_cl_tokens) return;
+  int resident = 0;
+  for (int i = 0; i < g_cl_num_weights; i++) resident += g_cl_weights[i].buf != NULL;
+  fprintf(stderr, "GPT2_CL_BUDGET: %d of %d weights resident (%.0f of %.0f MB); %.1f%% resident, "
+          "%.1f%% prefetched, %.1f%% copied on demand; %.1f MB copied per token\n",
+          resident, g_cl_num_weights, g_cl_resident_bytes / 1e6, g_cl_budget / 1e6,
+          100. * g_cl_resident_hits / total, 100. * g_cl_prefetch_hits / total,
+          100. * g_cl_weight_misses / total, g_cl_upload_bytes / 1e6 / g_cl_tokens);
+}
+
+void cl_weight_evict(cl_weight_t* w) {
+  clReleaseMemObject(w->buf);
+  if (w->uploaded) clReleaseEvent(w->uploaded);
+  w->buf = NULL;
+  w->uploaded = NULL;
+  g_cl_resident_bytes -= w->bytes;
+}
+
+void cl_weights_release() {
+  cl_weights_report();
+  for (int i = 0; i < g_cl_num_weights; i++) if (g_cl_weights[i].buf) cl_weight_evict(g_cl_weights + i);
+  for (int i = 0; i < 2; i++) {
+    cl_staging_t* st = g_cl_staging + i;
+    if (st->buf) clReleaseMemObject(st->buf);
+    if (st->uploaded) clReleaseEvent(st->uploaded);
+    if (st->used) clReleaseEvent(st->used);
+  }
+  memset(g_cl_staging, 0, sizeof(g_cl_staging));
+  g_cl_num_weights = 0;
+}
+
+// Copy w to a new device buffer of its own, if that fits or if it is used
+// more than the weight it would take the place of. Returns 0 if it did not.
+int cl_weight_admit(int w) {
+  cl_weight_t* cw = g_cl_weights + w;
+  while (g_cl_resident_bytes + cw->bytes > g_cl_budget) {
+    cl_weight_t* victim = NULL;
+    // The last weight is wte, which stays
+    for (int i = 0; i < g_cl_num_weights - 1; i++) {
+      cl_weight_t* v = g_cl_weights + i;
+      if (v->buf && (!victim || v->uses < victim->uses ||
+                     (v->uses == victim->uses && v->last_use < victim->last_use))) victim = v;
+    }
+    if (!victim || victim->uses >= cw->uses) return 0;
+    cl_weight_evict(victim);
+  }
+  cl_int err;
+  cw->buf = clCreateBuffer(g_cl_context, CL_MEM_READ_ONLY, cw->bytes, NULL, &err);
+  if (err != CL_SUCCESS) {
+    cw->buf = NULL;
+    return 0;
+  }
+  g_cl_resident_bytes += cw->bytes;
+  if (clEnqueueWriteBuffer(g_cl_upload_queue, cw->buf, CL_FALSE, 0, cw->bytes, cw->host, 0, NULL, &cw->uploaded) != CL_SUCCESS) {
+    cl_weight_evict(cw);
+    return 0;
+  }
+  clFlush(g_cl_upload_queue);
+  g_cl_upload_bytes += cw->bytes;
+  return 1;
+}
+
+// Take on the weights (dense, as the kernels want them), then wte. Not
+// when GPT2_CL_PIPELINE holds the whole model on the device already: its
+// copies would only take memory from it.
+void cl_weights_init(Matrix* weights, int n, Matrix wte) {
+  if (!g_cl_upload_queue || !g_cl_matmul.kernels[0] || n >= MAX_CL_WEIGHTS || g_cl_pipeline_ready) return;
+  char* budget = getenv("GPT2_CL_BUDGET");
+  g_cl_budget = budget ? atof(budget) * (1 << 20) : g_cl_mem_size / 4 * 3;
+  size_t largest = 0;
+  for (int i = 0; i <= n; i++) {
+    Matrix w = i < n ? weights[i] : wte;
+    cl_weight_t cw = {w.dat, (size_t)w.rows * w.cols * sizeof(float), NULL, NULL, 0, 0, -1};
+    g_cl_weights[i] = cw;
+    if (cw.bytes > largest) largest = cw.bytes;
+  }
+  g_cl_num_weights = n + 1;
+  // wte goes first, so it stays (it is not replaced, see cl_weight_admit)
+  if (cl_weight_admit(n)) largest = 0;
+  for (int i = 0; i < n; i++) if (g_cl_weights[i].bytes > largest) largest = g_cl_weights[i].bytes;
+
+  for (int i = 0; i < 2; i++) {
+    cl_int err;
+    g_cl_staging[i].buf = clCreateBuffer(g_cl_context, CL_MEM_READ_ONLY, largest, NULL, &err);
+    g_cl_staging[i].weight = -1;
+    if (err != CL_SUCCESS) {
+      cl_weights_release();
+      return;
+    }
+  }
+}
+
+// Copy w into a staging buffer (once the last kernel that read that one is
+// done), unless it is in one already. Returns the staging buffer.
+cl_staging_t* cl_weight_stage(int w) {
+  for (int i = 0; i < 2; i++) if (g_cl_staging[i].weight == w) return g_cl_staging + i;
+  cl_staging_t* st = g_cl_staging + g_cl_next_staging;
+  g_cl_next_staging ^= 1;
+  if (st->uploaded) clReleaseEvent(st->uploaded);
+  st->uploaded = NULL;
+  st->weight = -1;
+  cl_weight_t* cw = g_cl_weights + w;
+  if (clEnqueueWriteBuffer(g_cl_upload_queue, st->buf, CL_FALSE, 0, cw->bytes, cw->host,
+                           st->used != NULL, st->used ? &st->used : NULL, &st->uploaded) != CL_SUCCESS) return NULL;
+  clFlush(g_cl_upload_queue);
+  g_cl_upload_bytes += cw->bytes;
+  st->weight = w;
+  return st;
+}
+
+// The device buffer holding the weight at host, or NULL if it is not one
+// of the weights. The kernel has to wait for *ready (when set; release it
+// after), and its event then goes to cl_weight_used.
+cl_mem cl_weight_buffer(const float* host, cl_event* ready, cl_staging_t** staging) {
+  *ready = NULL;
+  *staging = NULL;
+  int w = 0;
+  while (w < g_cl_num_weights && g_cl_weights[w].host != host) w++;
+  if (w == g_cl_num_weights) return NULL;
+  cl_weight_t* cw = g_cl_weights + w;
+  cw->uses++;
+  cw->last_use = ++g_cl_weight_clock;
+  if (g_cl_last_weight >= 0) g_cl_weights[g_cl_last_weight].next = w;
+  g_cl_last_weight = w;
+  g_cl_tokens += w == g_cl_num_weights - 1;  // wte is used once per token
+
+  if (cw->buf || cl_weight_admit(w)) {
+    g_cl_resident_hits++;
+    *ready = cw->uploaded;
+    clRetainEvent(*ready);
+    return cw->buf;
+  }
+
+  int staged = g_cl_staging[0].weight == w || g_cl_staging[1].weight == w;
+  cl_staging_t* st = cl_weight_stage(w);
+  if (!st) return NULL;
+  staged ? g_cl_prefetch_hits++ : g_cl_weight_misses++;
+  *ready = st->uploaded;
+  clRetainEvent(*ready);
+  *staging = st;
+  return st->buf;
+}
+
+// A kernel reading the last weight was enqueued, done is its event. If it
+// reads a staging buffer that buffer is free again once it is done. Start
+// copying the weight that is likely to come next.
+void cl_weight_used(cl_staging_t* staging, cl_event done) {
+  if (staging) {
+    if (staging->used) clReleaseEvent(staging->used);
+    staging->used = done;
+    clRetainEvent(done);
+  }
+  int w = g_cl_last_weight, next = g_cl_weights[w].next;
+  if (next >= 0 && next != w && !g_cl_weights[next].buf) cl_weight_stage(next);
+  if (w == g_cl_num_weights - 1 && g_cl_tokens % 100 == 0) cl_weights_report();
+}
+
 void init_opencl() {
   cl_int err;
   gpu_device_info_t gpu_info;
   if (select_best_gpu_device(&gpu_info) != 0) return;
 
   g_cl_device = gpu_info.device;
+  g_cl_host_align = cl_host_align(&gpu_info);
+  if (g_cl_host_align > g_matrix_align) g_matrix_align = g_cl_host_align;
   g_cl_context = create_gpu_context(&gpu_info, &err);
   if (err != CL_SUCCESS) return;
 
-  g_cl_queue = create_gpu_queue(g_cl_context, &gpu_info, CL_FALSE, &err);
+  // GPT2_CL_SPLIT times the device side of every split matmul from the profiling
+  // info, and GPT2_TRACE draws the commands from it
+  g_cl_queue = create_gpu_queue(g_cl_context, &gpu_info, getenv("GPT2_CL_SPLIT") || getenv("GPT2_TRACE"), &err);
   if (err != CL_SUCCESS) return;
+  g_cl_mem_size = gpu_info.global_mem_size;
+  if (!g_cl_host_align) {
+    g_cl_upload_queue = create_gpu_queue(g_cl_context, &gpu_info, CL_FALSE, &err);
+    if (err != CL_SUCCESS) return;
+  }
 
-  size_t source_size;
-  char *source = load_kernel_source("test/matrix_kernels.cl", &source_size);
-  if (!source) return;
-
-  g_cl_program = clCreateProgramWithSource(g_cl_context, 1, (const char**)&source, &source_size, &err);
-  free(source);
-  if (err != CL_SUCCESS) return;
+  g_cl_program = build_program(g_cl_context, g_cl_device, NULL);
+  if (!g_cl_program) return;
 
-  err = clBuildProgram(g_cl_program, 1, &g_cl_device, NULL, NULL, NULL);
-  if (err != CL_SUCCESS) return;
+  if (cl_matmul_init(&g_cl_matmul, g_cl_program, g_cl_device)) cl_matmul_release(&g_cl_matmul);
+}
 
-  g_cl_kernel_matmul_a_bt = clCreateKernel(g_cl_program, "matmul_a_bt", &err);
-  if (err != CL_SUCCESS) return;
+void cl_topk_release() {
+  if (g_cl_topk) clReleaseKernel(g_cl_topk);
+  cl_mem tops[] = {g_cl_top_vals[0], g_cl_top_vals[1], g_cl_top_ids[0], g_cl_top_ids[1]};
+  for (int i = 0; i < 4; i++) if (tops[i]) clReleaseMemObject(tops[i]);
+  g_cl_topk = 0;
+  memset(g_cl_top_vals, 0, sizeof(g_cl_top_vals));
+  memset(g_cl_top_ids, 0, sizeof(g_cl_top_ids));
 }
 
 void shutdown_opencl() {
-  if (g_cl_kernel_matmul_a_bt) clReleaseKernel(g_cl_kernel_matmul_a_bt);
+  for (int d = 0; d < MAX_SHARDS; d++) {
+    cl_pipeline_t *p = g_cl_shards + d;
+    if (p->queue) clFinish(p->queue);
+    if (p->tail) clReleaseEvent(p->tail);
+    cl_kernel kernels[] = {p->embed, p->layernorm, p->fused, p->attention, p->topk};
+    for (int i = 0; i < 5; i++) if (kernels[i]) clReleaseKernel(kernels[i]);
+    if (p->program != g_cl_program) cl_matmul_release(&p->matmul);
+    cl_mem bufs[] = {p->wpe, p->wte, p->tokens, p->line, p->ln, p->qkv, p->attn, p->hidden, p->proj, p->last, p->logits,
+                     p->top_vals[0], p->top_vals[1], p->top_ids[0], p->top_ids[1]};
+    for (int i = 0; i < 15; i++) if (bufs[i]) clReleaseMemObject(bufs[i]);
+    for (int i = 0; i < p->num_weights; i++) if (p->weights[i]) clReleaseMemObject(p->weights[i]);
+    free(p->weights);
+    free(p->host);
+    if (p->queue && p->queue != g_cl_queue) clReleaseCommandQueue(p->queue);
+    if (p->program && p->program != g_cl_program) clReleaseProgram(p->program);
+    if (p->context && p->context != g_cl_context) {
+      clReleaseContext(p->context);
+      clReleaseDevice(p->device);
+    }
+    memset(p, 0, sizeof(*p));
+  }
+  free(g_cl_stage);
+  g_cl_stage = 0;
+  g_cl_num_shards = 0;
+  g_cl_pipeline_ready = 0;
+
+  cl_topk_release();
+
+  cl_weights_release();
+  cl_matmul_release(&g_cl_matmul);
   if (g_cl_program) clReleaseProgram(g_cl_program);
+  if (g_cl_upload_queue) clReleaseCommandQueue(g_cl_upload_queue);
   if (g_cl_queue) clReleaseCommandQueue(g_cl_queue);
   if (g_cl_context) clReleaseContext(g_cl_context);
-  g_cl_kernel_matmul_a_bt = 0;
   g_cl_program = 0;
   g_cl_queue = 0;
+  g_cl_upload_queue = 0;
   g_cl_context = 0;
 }
 
 // Standard stuff here. Let's save space with all our loops
 #define LOOP(i, j) for (int i = 0; i < j; i++)
 
+// Huge pages. The arena holds the weights and every activation, and it is
+// read with large strides (embedding rows, the 50k row logits product), so
+// with 4 KB pages much of the time goes to TLB misses. GPT2_HUGE_PAGES picks
+// how it is backed: "1g" or "2m" for explicit MAP_HUGETLB pages (these have
+// to be reserved first, e.g. in /proc/sys/vm/nr_hugepages), "thp" for
+// transparent huge pages requested with madvise, "0" for plain pages. By
+// default each of 1g, 2m and thp is tried in turn. The page aligned
+// result is never freed; which backing it got is reported on stderr.
+void* alloc_arena(size_t bytes) {
+  const char* names[] = {"1g", "2m", "thp"};
+  const char* what[] = {"1 GB pages", "2 MB pages", "transparent huge pages"};
+  int shifts[] = {30, 21, 21};
+  char* mode = getenv("GPT2_HUGE_PAGES");
+  LOOP(i, 3) {
+    if (mode && strcmp(mode, names[i])) continue;
+    size_t page = (size_t)1 << shifts[i], n = cl_round_up(bytes, page);
+    char* p;
+    if (i < 2) {
+      p = mmap(NULL, n, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | shifts[i] << MAP_HUGE_SHIFT, -1, 0);
+      if (p == MAP_FAILED) continue;
+    } else {
+      // Over-allocate to cut out a 2 MB aligned range, so whole huge pages fit
+      char* map = mmap(NULL, n + page, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (map == MAP_FAILED) continue;
+      p = (char*)cl_round_up((size_t)map, page);
+      if (p > map) munmap(map, p - map);
+      munmap(p + n, map + page - p);
+      if (madvise(p, n, MADV_HUGEPAGE)) {
+        munmap(p, n);
+        continue;
+      }
+    }
+    fprintf(stderr, "GPT2_HUGE_PAGES: %.1f GB arena on %s\n", n / 1e9, what[i]);
+    return p;
+  }
+  fprintf(stderr, "GPT2_HUGE_PAGES: %.1f GB arena on 4 KB pages\n", bytes / 1e9);
+  return aligned_alloc(4096, cl_round_up(bytes, 4096));
+}
+
 // A matrix is just a 2d vector of floats with rows and columns.
+// Each one starts on a g_matrix_align boundary of the (page aligned) arena.
 Matrix NewMatrix(int rows, int cols, int reuse) {
   float* a = memory;
-  memory += tmp=4*rows*cols; 
-  memset(a, 0, tmp*reuse);
-  Matrix out = {a, rows, cols};
+  memory += (4*rows*cols + g_matrix_align-1) / g_matrix_align * g_matrix_align;
+  memset(a, 0, (tmp=4*rows*cols)*reuse);
+  Matrix out = {a, rows, cols, cols, 1};
   return out;
 }
 
+// Fast exp, tanh and 1/sqrt over float arrays.
+// libm's exp and tanh take one double at a time (the double constants in
+// the expressions below promote everything), and the attention softmax,
+// GELU and LayerNorm call them for every entry. These do VW floats at once with AVX-512,
+// AVX2 + FMA, or plain scalar code, whichever the compiler targets (build
+// with -march=native to get the vector ones):
+//   exp:  Cody-Waite reduction to [-ln2/2, ln2/2] and a degree 6 polynomial,
+//         within 1.5 ulp of the true value for x in [-87, 88] (outside that
+//         the input is clamped, so it never returns 0 or inf)
+//   tanh: an odd polynomial for |x| < 0.625, 1 - 2/(exp(2x)+1) above it,
+//         within 2 ulp
+//   rsqrt (for LayerNorm): the hardware estimate (relative error 2^-14
+//         with AVX-512, 1.5 * 2^-12 with AVX2) and one Newton step,
+//         y + y * (1/2 - x/2 * y^2), within 2.5 ulp with AVX-512 and 4.5
+//         with AVX2 (the Newton step leaves 3/2 of the estimate's error
+//         squared)
+// test/test_fast_math.c checks these bounds and how far the logits move.
+// GPT2_EXACT_MATH=1 goes back to libm.
+int g_exact_math;
+
+#if defined(__AVX512F__)
+#include<immintrin.h>
+#define VW 16
+typedef __m512 vfloat;
+#define v_set(x) _mm512_set1_ps(x)
+#define v_load(p) _mm512_loadu_ps(p)
+#define v_store(p, x) _mm512_storeu_ps(p, x)
+#define v_add(a, b) _mm512_add_ps(a, b)
+#define v_sub(a, b) _mm512_sub_ps(a, b)
+#define v_mul(a, b) _mm512_mul_ps(a, b)
+#define v_div(a, b) _mm512_div_ps(a, b)
+#define v_fma(a, b, c) _mm512_fmadd_ps(a, b, c)
+#define v_min(a, b) _mm512_min_ps(a, b)
+#define v_max(a, b) _mm512_max_ps(a, b)
+#define v_floor(x) _mm512_roundscale_ps(x, _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC)
+#define v_bits(x, m) _mm512_castsi512_ps(_mm512_and_si512(_mm512_castps_si512(x), _mm512_set1_epi32(m)))
+#define v_sign(m, x) _mm512_castsi512_ps(_mm512_or_si512(_mm512_castps_si512(m), _mm512_castps_si512(v_bits(x, 0x80000000))))
+#define v_pow2(n) _mm512_castsi512_ps(_mm512_slli_epi32(_mm512_add_epi32(_mm512_cvtps_epi32(n), _mm512_set1_epi32(127)), 23))
+#define v_select_lt(a, b, x, y) _mm512_mask_blend_ps(_mm512_cmp_ps_mask(a, b, _CMP_LT_OQ), y, x)
+#define v_gt_mask(a, b) _mm512_cmp_ps_mask(a, b, _CMP_GT_OQ)
+#define v_rsqrt_estimate(x) _mm512_rsqrt14_ps(x)
+#elif defined(__AVX2__) && defined(__FMA__)
+#include<immintrin.h>
+#define VW 8
+typedef __m256 vfloat;
+#define v_set(x) _mm256_set1_ps(x)
+#define v_load(p) _mm256_loadu_ps(p)
+#define v_store(p, x) _mm256_storeu_ps(p, x)
+#define v_add(a, b) _mm256_add_ps(a, b)
+#define v_sub(a, b) _mm256_sub_ps(a, b)
+#define v_mul(a, b) _mm256_mul_ps(a, b)
+#define v_div(a, b) _mm256_div_ps(a, b)
+#define v_fma(a, b, c) _mm256_fmadd_ps(a, b, c)
+#define v_min(a, b) _mm256_min_ps(a, b)
+#define v_max(a, b) _mm256_max_ps(a, b)
+#define v_floor(x) _mm256_floor_ps(x)
+#define v_bits(x, m) _mm256_and_ps(x, _mm256_castsi256_ps(_mm256_set1_epi32(m)))
+#define v_sign(m, x) _mm256_or_ps(m, v_bits(x, 0x80000000))
+#define v_pow2(n) _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_add_epi32(_mm256_cvtps_epi32(n), _mm256_set1_epi32(127)), 23))
+#define v_select_lt(a, b, x, y) _mm256_blendv_ps(y, x, _mm256_cmp_ps(a, b, _CMP_LT_OQ))
+#define v_gt_mask(a, b) _mm256_movemask_ps(_mm256_cmp_ps(a, b, _CMP_GT_OQ))
+#define v_rsqrt_estimate(x) _mm256_rsqrt_ps(x)
+#else
+#define VW 1
+typedef float vfloat;
+static inline float scalar_bits(float x, unsigned m) { unsigned u; memcpy(&u, &x, 4); u &= m; memcpy(&x, &u, 4); return x; }
+static inline float scalar_pow2(float n) { int u = ((int)n + 127) << 23; float x; memcpy(&x, &u, 4); return x; }
+#define v_set(x) ((float)(x))
+#define v_load(p) (*(p))
+#define v_store(p, x) (*(p) = (x))
+#define v_add(a, b) ((a) + (b))
+#define v_sub(a, b) ((a) - (b))
+#define v_mul(a, b) ((a) * (b))
+#define v_div(a, b) ((a) / (b))
+#define v_fma(a, b, c) ((a) * (b) + (c))
+#define v_min(a, b) fminf(a, b)
+#define v_max(a, b) fmaxf(a, b)
+#define v_floor(x) floorf(x)
+#define v_bits(x, m) scalar_bits(x, m)
+#define v_sign(m, x) copysignf(m, x)
+#define v_pow2(n) scalar_pow2(n)
+#define v_select_lt(a, b, x, y) ((a) < (b) ? (x) : (y))
+#define v_gt_mask(a, b) ((a) > (b))
+#endif
+
+static inline vfloat v_exp(vfloat x) {
+  x = v_max(v_min(x, v_set(88.f)), v_set(-87.f));
+  vfloat n = v_floor(v_fma(x, v_set(1.44269504f), v_set(.5f)));
+  x = v_fma(n, v_set(-.693359375f), x);
+  x = v_fma(n, v_set(2.12194440e-4f), x);
+  vfloat p = v_set(1.9875691500e-4f);
+  p = v_fma(p, x, v_set(1.3981999507e-3f));
+  p = v_fma(p, x, v_set(8.3334519073e-3f));
+  p = v_fma(p, x, v_set(4.1665795894e-2f));
+  p = v_fma(p, x, v_set(1.6666665459e-1f));
+  p = v_fma(p, x, v_set(5.0000001201e-1f));
+  p = v_fma(p, v_mul(x, x), v_add(x, v_set(1)));
+  return v_mul(p, v_pow2(n));
+}
+
+static inline vfloat v_tanh(vfloat x) {
+  vfloat a = v_bits(x, 0x7fffffff), z = v_mul(x, x);
+  vfloat p = v_set(-5.70498872745e-3f);
+  p = v_fma(p, z, v_set(2.06390887954e-2f));
+  p = v_fma(p, z, v_set(-5.37397155531e-2f));
+  p = v_fma(p, z, v_set(1.33314422036e-1f));
+  p = v_fma(p, z, v_set(-3.33332819422e-1f));
+  vfloat small = v_fma(v_mul(p, z), x, x);
+  vfloat big = v_sub(v_set(1), v_div(v_set(2), v_add(v_exp(v_add(a, a)), v_set(1))));
+  return v_select_lt(a, v_set(.625f), small, v_sign(big, x));
+}
+
+static inline vfloat v_rsqrt(vfloat x) {
+  #if VW == 1
+  return 1.f / sqrtf(x);
+  #else
+  vfloat y = v_rsqrt_estimate(x), h = v_mul(x, v_set(.5f));
+  return v_fma(y, v_fma(v_mul(h, y), v_sub(v_set(0), y), v_set(.5f)), y);
+  #endif
+}
+
+static inline vfloat v_gelu(vfloat b) {
+  vfloat u = v_mul(v_set(.7978845f), v_fma(v_mul(v_set(.044715f), b), v_mul(b, b), b));
+  return v_mul(v_mul(b, v_set(.5f)), v_add(v_set(1), v_tanh(u)));
+}
+
+// Vector meta-function: x[i] = f(x[i]*k) over n floats, VW at a time, with
+// vf the vector version of f and opr the libm one (in terms of b = x[i]*k).
+#define VECTOR(fn, vf, opr) void fn(float* x, int n, float k) { \
+  if (g_exact_math) { LOOP(i, n) { float b = x[i]*k; x[i] = opr; } return; } \
+  int i = 0; \
+  for (; i + VW <= n; i += VW) v_store(x + i, vf(v_mul(v_load(x + i), v_set(k)))); \
+  if (i < n) { float t[VW] = {0}; memcpy(t, x + i, (n - i) * 4); v_store(t, vf(v_mul(v_load(t), v_set(k)))); memcpy(x + i, t, (n - i) * 4); } }
+
 // Unary matrix meta-function here.
 // Loop over every entry in a matrix and operate on it
 // (independent of any other entry, possibly using some constant k)
-#define UNARY(fn, opr) Matrix fn(Matrix a, float k) { LOOP(i, a.rows*a.cols) { float b = a.dat[i]; a.dat[i] = opr; } return a;}
+#define UNARY(fn, opr) Matrix fn(Matrix a, float k) { LOOP(i, a.rows*a.cols) { float b = a.dat[IDX(a, i)]; a.dat[IDX(a, i)] = opr; } return a;}
 
 
 UNARY(divide_const, b/k)                   // divide by a constant
 UNARY(add_const, b+k)                      // add a constant
-UNARY(mat_isqrt, 1./sqrt(b))               // square root each entry
 UNARY(mat_exp, exp(b))                     // exponetiate each entry
-UNARY(broadcast, a.dat[(i/a.cols)*a.cols]) // copy the first column to every column
+UNARY(broadcast, a.dat[IDX(a, i/a.cols*a.cols)]) // copy the first column to every column
 
-// Tril is the first of two special functions.
+// GELU is the activation function used for transformers
+#define GELU_OF(b) ((b) / 2 * (1 + tanh(.7978845 * ((b) + .044715 * (b) * (b) * (b)))))
+UNARY(GELU, GELU_OF(b))
+
+VECTOR(exp_array, v_exp, exp(b))
+VECTOR(tanh_array, v_tanh, tanh(b))
+VECTOR(gelu_array, v_gelu, GELU_OF(b))
+VECTOR(rsqrt_array, v_rsqrt, 1./sqrt(b))
+
+// 1/sqrt of each entry of a dense matrix
+Matrix mat_isqrt(Matrix a, float k) {
+  rsqrt_array(a.dat, a.rows*a.cols, 1);
+  return a;
+}
+
+// Tril is the other special function.
 //   a   b   c        exp(a/8) exp(b/8) exp(c/8)
 //   d   e   f   ->      0     exp(e/8) exp(f/8)
 //   g   h   i           0        0        0
 // it's use will be described later
-UNARY(tril, (i/k<i%(int)k) ? 0 : exp(b/8))
-
-// GELU is the activation function used for transformers
-UNARY(GELU, b / 2 * (1 + tanh(.7978845 * (b + .044715 * b * b * b))))
+// (a is a fresh, dense product whose first row is row k of the full
+// matrix; each row's exps go through exp_array)
+Matrix tril(Matrix a, float k) {
+  LOOP(i, a.rows) {
+	int n = i + k < a.cols ? i + k + 1 : a.cols;
+	exp_array(a.dat + i*a.cols, n, 1./8);
+	memset(a.dat + i*a.cols + n, 0, (a.cols - n) * sizeof(float));
+  }
+  return a;
+}
 
 // Binary matrix meta-function here.
 // Loop over pairs of entries in two matricies and operate on them
-#define BINARY(fn, opr) Matrix fn(Matrix a, Matrix b) {LOOP(i, a.rows*a.cols) { a.dat[i] = a.dat[i] opr b.dat[i]; } return a; }
+#define BINARY(fn, opr) Matrix fn(Matrix a, Matrix b) {LOOP(i, a.rows*a.cols) { a.dat[IDX(a, i)] = a.dat[IDX(a, i)] opr b.dat[IDX(b, i)]; } return a; }
   
 BINARY(add, +)      // add two matrices together
 BINARY(multiply, *) // multiply two matrices together 
@@ -161,148 +969,2507 @@ BINARY(divide, /)   // divide the first matrix by the second
 // To do this tiling, we don't want to operate on b.dat[i], so instead
 // we re-index with what we want and then just stick a ; there to
 // drop the actual b.dat[i]
-BINARY(add_tile, + b.dat[i%a.cols] ; )
-BINARY(multiply_tile, * b.dat[i%a.cols] ; )
+BINARY(add_tile, + b.dat[IDX(b, i%a.cols)] ; )
+BINARY(multiply_tile, * b.dat[IDX(b, i%a.cols)] ; )
   
 // Compute the sum of the rows in a matrix, populating each row with the same sum
 Matrix sum(Matrix a) {
   Matrix out = NewMatrix(a.rows, a.cols, 1);
 
   LOOP(i, a.rows*a.cols) {
-	out.dat[(i/a.cols)*a.cols] += a.dat[i];
+	out.dat[(i/a.cols)*a.cols] += a.dat[IDX(a, i)];
   }  
 
-  broadcast(out, 0);
-  return out;
-}  
+  broadcast(out, 0);
+  return out;
+}  
+
+// Transpose a matrix flipping the rows and columns.
+// This is free: the result is a view of the same data with the strides swapped.
+Matrix transpose(Matrix a) {
+  Matrix out = {a.dat, a.cols, a.rows, a.col_stride, a.row_stride};
+  return out;
+}
+
+// Copy a view into a new dense matrix (a dense matrix is returned as is)
+Matrix dense(Matrix a) {
+  if (is_dense(a)) return a;
+  Matrix out = NewMatrix(a.rows, a.cols, 0);
+  #ifdef GOFAST
+  #pragma omp parallel for
+  #endif
+  LOOP(i, a.rows) {
+	LOOP(j, a.cols) {
+	  out.dat[i*a.cols+j] = AT(a, i, j);
+	}
+  }
+  return out;
+}
+
+// A chain of elementwise ops fused onto a product, so that they run on each
+// block of outputs while it is still in cache instead of as separate passes
+// over the whole matrix. They apply in this order: add the bias row, GELU,
+// add the residual (a matrix shaped like the product), multiply by scale.
+// Leave out what isn't needed, e.g. &(epilogue_t){bias, .gelu = 1}.
+typedef struct {
+  Matrix bias;
+  int gelu;
+  Matrix residual;
+  float scale;
+} epilogue_t;
+
+// Where matmul_cpu stores output (i, j) of a rows x cols product, see matmul_t_blocked
+#define OUT_IDX(i, j, rows, cols, block) ((block) ? ((j)/(block)*(rows) + (i))*(block) + (j)%(block) : (i)*(cols) + (j))
+
+// Run e over s, the n outputs at row i and columns j..j+n, and store them in out
+void epilogue_store(const epilogue_t* e, float* s, int n, Matrix out, int i, int j, int rows, int cols, int block) {
+  if (e && e->bias.dat) LOOP(c, n) s[c] += AT(e->bias, 0, j + c);
+  if (e && e->gelu) gelu_array(s, n, 1);
+  if (e && e->residual.dat) LOOP(c, n) s[c] += AT(e->residual, i, j + c);
+  if (e && e->scale) LOOP(c, n) s[c] *= e->scale;
+  LOOP(c, n) out.dat[OUT_IDX(i, j + c, rows, cols, block)] = s[c];
+}
+
+// Apply e to columns j0..j1 of an already computed product in out
+void epilogue_apply(const epilogue_t* e, Matrix out, int rows, int cols, int j0, int j1, int block) {
+  #ifdef GOFAST
+  #pragma omp parallel for
+  #endif
+  LOOP(i, rows) {
+    for (int c = j0; c < j1; c += 64) {
+      int n = c + 64 < j1 ? 64 : j1 - c;
+      float s[64];
+      LOOP(j, n) s[j] = out.dat[OUT_IDX(i, c + j, rows, cols, block)];
+      epilogue_store(e, s, n, out, i, c, rows, cols, block);
+    }
+  }
+}
+
+// NUMA. On a multi-socket machine the weights end up on whichever node
+// first touches them while they are read in, and the threads on the other
+// sockets then stream them over the interconnect. GPT2_NUMA picks a fix:
+//   interleave  spread the weight pages round-robin over the nodes
+//   replicate   give every node its own copy of the weights, and have each
+//               thread read the copy on its own node
+// With GOFAST the OpenMP threads are also pinned to the nodes in contiguous
+// blocks, so the static schedule of a matmul hands each node its own range
+// of output columns. This talks to the kernel (mbind, sysfs) directly, so
+// libnuma is not needed.
+#define MAX_NODES 64
+enum { NUMA_BIND = 2, NUMA_INTERLEAVE = 3 };  // MPOL_* in <numaif.h>
+#define NUMA_MOVE 2                           // MPOL_MF_MOVE
+
+int g_numa_nodes;               // 0 unless GPT2_NUMA is on
+int g_numa_replicate;           // GPT2_NUMA=replicate, not interleave
+int g_numa_ids[MAX_NODES];      // the online nodes
+float *g_numa_base, *g_numa_end;  // the replicated weights
+float* g_numa_replica[MAX_NODES];
+#define MAX_CPUS 1024
+unsigned char g_numa_cpu_node[MAX_CPUS];  // index of each CPU's node in g_numa_ids (0xff: none)
+
+// Read a sysfs list like "0-3,8-11" into ids[], returning how many there are
+int read_id_list(const char* path, int* ids, int max) {
+  FILE* f = fopen(path, "r");
+  int n = 0, a, b;
+  if (!f) return 0;
+  while (fscanf(f, "%d", &a) == 1) {
+    b = a;
+    fscanf(f, "-%d", &b);
+    for (; a <= b && n < max; a++) ids[n++] = a;
+    if (fgetc(f) != ',') break;
+  }
+  fclose(f);
+  return n;
+}
+
+long numa_mbind(void* addr, size_t len, int mode, unsigned long mask, unsigned flags) {
+  return syscall(SYS_mbind, addr, len, mode, &mask, MAX_NODES + 1, flags);
+}
+
+// Find the nodes and pin the threads to them
+void numa_init() {
+  char* mode = getenv("GPT2_NUMA");
+  if (!mode || !*mode) return;
+  if (strcmp(mode, "interleave") && strcmp(mode, "replicate")) {
+    fprintf(stderr, "GPT2_NUMA: unknown mode %s, leaving the weights where they are\n", mode);
+    return;
+  }
+  g_numa_replicate = !strcmp(mode, "replicate");
+  g_numa_nodes = read_id_list("/sys/devices/system/node/online", g_numa_ids, MAX_NODES);
+  if (g_numa_nodes < 2) {
+    fprintf(stderr, "GPT2_NUMA: only one NUMA node, nothing to do\n");
+    g_numa_nodes = 0;
+    return;
+  }
+  memset(g_numa_cpu_node, 0xff, sizeof(g_numa_cpu_node));
+  LOOP(d, g_numa_nodes) {
+    int cpus[MAX_CPUS];
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", g_numa_ids[d]);
+    int n = read_id_list(path, cpus, MAX_CPUS);
+    LOOP(c, n) g_numa_cpu_node[cpus[c]] = d;
+  }
+  // The pinning is only for locality: which copy a thread reads is decided
+  // by the CPU it is on when it reads (see numa_local), so nothing depends
+  // on the OpenMP runtime keeping its threads and their numbers
+  #ifdef GOFAST
+  #pragma omp parallel
+  {
+    int node = omp_get_thread_num() * g_numa_nodes / omp_get_num_threads();
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    LOOP(c, MAX_CPUS) if (g_numa_cpu_node[c] == node) CPU_SET(c, &set);
+    sched_setaffinity(0, sizeof(set), &set);
+  }
+  #endif
+}
+
+// Place the weights, which are everything in start..end, on the nodes
+void numa_place(void* start, void* end) {
+  if (!g_numa_nodes) return;
+  size_t bytes = cl_round_up((char*)end - (char*)start, 4096);
+  unsigned long all = 0;
+  LOOP(d, g_numa_nodes) all |= 1UL << g_numa_ids[d];
+
+  if (!g_numa_replicate) {
+    // The pages are already there, so they have to be moved
+    if (numa_mbind(start, bytes, NUMA_INTERLEAVE, all, NUMA_MOVE)) perror("GPT2_NUMA: mbind");
+    return;
+  }
+  LOOP(d, g_numa_nodes) {
+    // Bound before the copy touches it, so every page is allocated on node d
+    float* copy = aligned_alloc(4096, bytes);
+    if (!copy || numa_mbind(copy, bytes, NUMA_BIND, 1UL << g_numa_ids[d], 0)) {
+      fprintf(stderr, "GPT2_NUMA: could not replicate the weights on node %d\n", g_numa_ids[d]);
+      while (d--) free(g_numa_replica[d]);
+      free(copy);
+      return;
+    }
+    memcpy(copy, start, bytes);
+    g_numa_replica[d] = copy;
+  }
+  g_numa_base = start;
+  g_numa_end = end;
+}
+
+// The copy of p on the calling thread's node, if p is in the weights
+static inline float* numa_local(float* p) {
+  if (p < g_numa_base || p >= g_numa_end) return p;
+  int cpu = sched_getcpu();
+  int node = cpu >= 0 && cpu < MAX_CPUS && g_numa_cpu_node[cpu] < g_numa_nodes ? g_numa_cpu_node[cpu] : 0;
+  return g_numa_replica[node] + (p - g_numa_base);
+}
+
+// Efficient incremental matrix multiplication.
+// We make the following optimizations:
+// 1. Instead of multiplying A by B, we do A by transpose(B)
+//    This keeps the reads out of the B matrix in sequential order
+//    which helps cache efficiency. When B is a view whose columns are
+//    contiguous instead (the weights, which are transposed views of the
+//    file) we add up rows of transpose(B) into each output row, which
+//    reads B sequentially as well
+// 2. Instaed of performing the product all at once, we block it
+//    into 4x4 inner computations which again is much more cache efficient
+// 3. If the fast flag is defined, we use OMP to parallelize across threads
+// 4. We re-use computation from prior runs, and only fill in the
+//    *new* rows that weren't populated the prior run through the model
+// This computes columns j0..j1 of the output on the CPU, and runs the
+// epilogue e (may be NULL) over them on the way out.
+// With block > 0 the output is stored in blocks, see matmul_t_blocked.
+void matmul_cpu(Matrix a, Matrix b, Matrix out, int j0, int j1, int block, const epilogue_t* e) {
+  #ifdef GOFAST
+  #pragma omp parallel
+  #endif
+  {
+  // Read this thread's node's copy of the weights (see numa_place)
+  Matrix w = b;
+  w.dat = numa_local(b.dat);
+  if (b.row_stride == 1 && b.col_stride != 1) {
+    // 64 output columns at a time, so the partial sums stay in cache.
+    // Columns are the outer loop, so each thread gets a range of them
+    // (and of the weights) for every row.
+    #ifdef GOFAST
+    #pragma omp for collapse(2)
+    #endif
+    for (int c = j0; c < j1; c += 64) {
+      for (int i = 0; i < a.rows; i++) {
+        int n = c + 64 < j1 ? 64 : j1 - c;
+        float s[64] = {0};
+        for (int k = 0; k < a.cols; k++) {
+          float x = AT(a, i, k);
+          float* row = w.dat + (size_t)k * b.col_stride + c;
+          for (int j = 0; j < n; j++) s[j] += x * row[j];
+        }
+        epilogue_store(e, s, n, out, i, c, a.rows, b.rows, block);
+      }
+    }
+  } else {
+    #ifdef GOFAST
+    #pragma omp for collapse(2)
+    #endif
+    for (int i = 0; i < a.rows; i++) {
+      for (int c = j0; c < j1; c += 64) {
+        int n = c + 64 < j1 ? 64 : j1 - c;
+        float s[64] = {0};
+        for (int j = 0; j < n; j++) {
+          for (int k = 0; k < a.cols; k++) {
+            s[j] += AT(a, i, k) * AT(w, c + j, k);
+          }
+        }
+        epilogue_store(e, s, n, out, i, c, a.rows, b.rows, block);
+      }
+    }
+  }
+  }
+}
+
+double now_seconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Trace recorder. With GPT2_TRACE=file the spans of the work done for
+// every token (the token, each layer, each op of a layer, each head, the
+// logits, the layer reads of GPT2_STREAM) are kept, per CPU thread, with
+// the OpenCL commands from their profiling info, and after every token
+// they are appended to file in the Chrome trace format (open it in
+// chrome://tracing or ui.perfetto.dev). A command is drawn on its queue's
+// track while it runs and on the track below while it waits to start.
+// Spans go into a lock-free ring, so any thread can record; when the ring
+// is full new spans are dropped (and counted).
+#define TRACE_EVENTS (1 << 20)
+#define TRACE_CL_MAX 4096
+#define TRACE_CL_TID 1000000  // the OpenCL tracks, two per queue
+
+typedef struct {
+  const char* name;
+  int arg;  // shown after the name when >= 0, e.g. "head 3"
+  int tid;
+  double t0, t1;
+} trace_event_t;
+
+// An OpenCL command whose times are read once it is done
+typedef struct {
+  cl_event ev;
+  int queue;
+  double enqueued;
+  char name[32];
+} trace_cl_t;
+
+trace_event_t* g_trace;  // NULL unless GPT2_TRACE
+_Atomic unsigned char* g_trace_ready;
+_Atomic unsigned long g_trace_head, g_trace_tail, g_trace_dropped;
+trace_cl_t g_trace_cl[TRACE_CL_MAX];
+int g_trace_num_cl;
+unsigned g_trace_named;  // the queues whose tracks have a name
+FILE* g_trace_file;
+double g_trace_t0;
+_Thread_local int t_trace_tid;
+
+void trace_add(const char* name, int arg, int tid, double t0, double t1) {
+  unsigned long i = atomic_load_explicit(&g_trace_head, memory_order_relaxed);
+  do {
+	if (i - atomic_load_explicit(&g_trace_tail, memory_order_acquire) >= TRACE_EVENTS) {
+	  atomic_fetch_add_explicit(&g_trace_dropped, 1, memory_order_relaxed);
+	  return;
+	}
+  } while (!atomic_compare_exchange_weak_explicit(&g_trace_head, &i, i + 1, memory_order_relaxed, memory_order_relaxed));
+  g_trace[i % TRACE_EVENTS] = (trace_event_t){name, arg, tid, t0, t1};
+  atomic_store_explicit(g_trace_ready + i % TRACE_EVENTS, 1, memory_order_release);
+}
+
+// double t = trace_begin(); ...; t = trace_end("op", -1, t); ...
+// Both are a load and a branch when tracing is off.
+double trace_begin() {
+  return g_trace ? now_seconds() : 0;
+}
+
+double trace_end(const char* name, int arg, double t0) {
+  if (!g_trace) return 0;
+  if (!t_trace_tid) t_trace_tid = syscall(SYS_gettid);
+  double now = now_seconds();
+  trace_add(name, arg, t_trace_tid, t0, now);
+  return now;
+}
+
+// Keep ev, a command just enqueued on OpenCL queue `queue` (0 for the
+// matmul queue, 1 + d for pipeline shard d), named after its kernel or name
+void trace_cl(int queue, cl_event ev, cl_kernel kernel, const char* name) {
+  if (!g_trace) return;
+  if (g_trace_num_cl == TRACE_CL_MAX) {
+	atomic_fetch_add_explicit(&g_trace_dropped, 1, memory_order_relaxed);
+	return;
+  }
+  trace_cl_t* c = g_trace_cl + g_trace_num_cl++;
+  c->ev = ev;
+  c->queue = queue;
+  c->enqueued = now_seconds();
+  snprintf(c->name, sizeof(c->name), "%s", name ? name : "kernel");
+  if (kernel) clGetKernelInfo(kernel, CL_KERNEL_FUNCTION_NAME, sizeof(c->name), c->name, NULL);
+  clRetainEvent(ev);
+}
+
+// Append the buffered JSON to the file in one write, so the lines of the
+// GPT2_SERVE workers, which share it, never mix
+void trace_write(char* buf, int* len) {
+  if (*len && write(fileno(g_trace_file), buf, *len) != *len) perror("GPT2_TRACE");
+  *len = 0;
+}
+
+// Write out everything recorded so far. Call it from one thread at a time,
+// with no OpenCL command of the traced ones still running.
+void trace_flush() {
+  static char buf[1 << 16];
+  int len = 0, pid = getpid();
+  if (!g_trace) return;
+
+  // The device clock is not the host's: each command's is lined up by
+  // the time it was queued, which is when the host enqueued it
+  LOOP(i, g_trace_num_cl) {
+	trace_cl_t* c = g_trace_cl + i;
+	cl_ulong queued, submit, start, end;
+	if (get_event_profiling_details(c->ev, &queued, &submit, &start, &end) == CL_SUCCESS) {
+	  int tid = TRACE_CL_TID + 2*c->queue;
+	  double offset = c->enqueued - queued * 1e-9;
+	  if (!(g_trace_named >> c->queue & 1)) {
+		g_trace_named |= 1u << c->queue;
+		len += sprintf(buf + len, "{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"OpenCL queue %d\"}},\n", pid, tid, c->queue);
+		len += sprintf(buf + len, "{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"OpenCL queue %d waiting\"}},\n", pid, tid + 1, c->queue);
+	  }
+	  len += sprintf(buf + len, "{\"name\":\"%s\",\"cat\":\"opencl\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,"
+					 "\"args\":{\"queued_to_submit_us\":%.3f,\"submit_to_start_us\":%.3f}},\n",
+					 c->name, pid, tid, (offset + start * 1e-9 - g_trace_t0) * 1e6, (end - start) * 1e-3,
+					 (submit - queued) * 1e-3, (start - submit) * 1e-3);
+	  len += sprintf(buf + len, "{\"name\":\"%s\",\"cat\":\"opencl\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f},\n",
+					 c->name, pid, tid + 1, (c->enqueued - g_trace_t0) * 1e6, (start - queued) * 1e-3);
+	}
+	clReleaseEvent(c->ev);
+	if (len > (int)sizeof(buf) - 1024) trace_write(buf, &len);
+  }
+  g_trace_num_cl = 0;
+
+  // The CPU spans, in the order they were added, up to the first one that
+  // is still being written
+  unsigned long i = atomic_load_explicit(&g_trace_tail, memory_order_relaxed);
+  unsigned long head = atomic_load_explicit(&g_trace_head, memory_order_acquire);
+  for (; i < head && atomic_load_explicit(g_trace_ready + i % TRACE_EVENTS, memory_order_acquire); i++) {
+	trace_event_t* e = g_trace + i % TRACE_EVENTS;
+	char name[64];
+	if (e->arg >= 0) snprintf(name, sizeof(name), "%s %d", e->name, e->arg);
+	else snprintf(name, sizeof(name), "%s", e->name);
+	len += sprintf(buf + len, "{\"name\":\"%s\",\"cat\":\"cpu\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f},\n",
+				   name, pid, e->tid, (e->t0 - g_trace_t0) * 1e6, (e->t1 - e->t0) * 1e6);
+	atomic_store_explicit(g_trace_ready + i % TRACE_EVENTS, 0, memory_order_relaxed);
+	if (len > (int)sizeof(buf) - 1024) trace_write(buf, &len);
+  }
+  atomic_store_explicit(&g_trace_tail, i, memory_order_release);
+  trace_write(buf, &len);
+
+  unsigned long dropped = atomic_exchange(&g_trace_dropped, 0);
+  if (dropped) fprintf(stderr, "GPT2_TRACE: %lu spans dropped\n", dropped);
+}
+
+// The file is a JSON array that is never closed, which both viewers accept
+void trace_init() {
+  char* path = getenv("GPT2_TRACE");
+  if (!path || !*path) return;
+  g_trace_file = fopen(path, "w");
+  if (!g_trace_file || fputs("[\n", g_trace_file) < 0 || fflush(g_trace_file)) {
+	perror("GPT2_TRACE");
+	return;
+  }
+  // From here on only whole lines are appended
+  if (!freopen(path, "a", g_trace_file)) {
+	perror("GPT2_TRACE");
+	return;
+  }
+  g_trace_ready = calloc(TRACE_EVENTS, 1);
+  g_trace = malloc(TRACE_EVENTS * sizeof(trace_event_t));
+  if (!g_trace || !g_trace_ready) {
+	fprintf(stderr, "GPT2_TRACE: OOM\n");
+	g_trace = NULL;
+	return;
+  }
+  g_trace_t0 = now_seconds();
+  fprintf(stderr, "GPT2_TRACE: writing %s\n", path);
+}
+
+// An OpenCL product of a with the first `cols` rows of b, in flight.
+typedef struct {
+  cl_mem a, b, c;
+  cl_event first, done;
+  void* mapped;  // c mapped for reading when it wraps out
+  int weight;    // b belongs to the weights (see cl_weight_buffer), not to the job
+  double enqueued;
+} cl_matmul_job_t;
+
+// Upload a and b[0:cols], and enqueue the product and a non-blocking read of it
+// straight into columns 0..cols of out (stored in blocks of `block` columns
+// when block > 0, see matmul_t_blocked). Returns without waiting.
+// With zero copy nothing is uploaded: the kernel reads a and b in place, and
+// when it computes all of out it writes there too and the read becomes a map.
+// With out.dat NULL nothing is read: the product stays in job->c for further
+// kernels, and job->done is the product itself.
+cl_int matmul_cl_enqueue(Matrix a, Matrix b, int cols, Matrix out, int block, cl_matmul_job_t* job) {
+  cl_int err;
+  memset(job, 0, sizeof(*job));
+  // The kernels only take dense matrices (the weights are made dense at load)
+  a = dense(a);
+  b = dense(b);
+  job->enqueued = now_seconds();
+  size_t bytes_a = (size_t)a.rows * (size_t)a.cols * sizeof(float);
+  size_t bytes_b = (size_t)cols * (size_t)b.cols * sizeof(float);
+  size_t bytes_c = (size_t)a.rows * (size_t)cols * sizeof(float);
+  int wrap_a = cl_host_aligned(g_cl_host_align, a.dat);
+  int wrap_b = cl_host_aligned(g_cl_host_align, b.dat);
+  int wrap_c = out.dat && cols == b.rows && !block && cl_host_aligned(g_cl_host_align, out.dat);
+
+  job->a = clCreateBuffer(g_cl_context, CL_MEM_READ_ONLY | (wrap_a ? CL_MEM_USE_HOST_PTR : 0), bytes_a, wrap_a ? a.dat : NULL, &err);
+  if (err != CL_SUCCESS) return err;
+  // A weight is read from its copy on the device (see cl_weight_buffer)
+  cl_event b_ready = NULL;
+  cl_staging_t* staging = NULL;
+  job->weight = !wrap_b && (job->b = cl_weight_buffer(b.dat, &b_ready, &staging));
+  if (!job->weight) {
+    job->b = clCreateBuffer(g_cl_context, CL_MEM_READ_ONLY | (wrap_b ? CL_MEM_USE_HOST_PTR : 0), bytes_b, wrap_b ? b.dat : NULL, &err);
+    if (err != CL_SUCCESS) return err;
+  }
+  job->c = clCreateBuffer(g_cl_context, CL_MEM_WRITE_ONLY | (wrap_c ? CL_MEM_USE_HOST_PTR : 0), bytes_c, wrap_c ? out.dat : NULL, &err);
+  if (err != CL_SUCCESS) return err;
+
+  if (!wrap_a) {
+    err = clEnqueueWriteBuffer(g_cl_queue, job->a, CL_FALSE, 0, bytes_a, a.dat, 0, NULL, &job->first);
+    if (err != CL_SUCCESS) return err;
+  }
+  if (!wrap_b && !job->weight) {
+    err = clEnqueueWriteBuffer(g_cl_queue, job->b, CL_FALSE, 0, bytes_b, b.dat, 0, NULL, job->first ? NULL : &job->first);
+    if (err != CL_SUCCESS) return err;
+  }
+
+  cl_uint M = (cl_uint)a.rows;
+  cl_uint N = (cl_uint)cols;
+  cl_uint K = (cl_uint)a.cols;
+
+  size_t global_work_size[2], local_work_size[2];
+  cl_event kernel_done;
+  cl_kernel kernel = cl_matmul_setup(&g_cl_matmul, job->a, job->b, job->c, NULL, M, N, K, global_work_size, local_work_size);
+  err = clEnqueueNDRangeKernel(g_cl_queue, kernel, 2, NULL, global_work_size, local_work_size,
+                               b_ready != NULL, b_ready ? &b_ready : NULL, &kernel_done);
+  if (b_ready) clReleaseEvent(b_ready);
+  if (err != CL_SUCCESS) return err;
+  trace_cl(0, kernel_done, kernel, NULL);
+  if (job->weight) cl_weight_used(staging, kernel_done);
+  if (!out.dat) {
+    clRetainEvent(kernel_done);
+    job->done = kernel_done;
+  }
+  if (job->first) clReleaseEvent(kernel_done);
+  else job->first = kernel_done;
+  if (!out.dat) return clFlush(g_cl_queue);
+
+  if (wrap_c) {
+    job->mapped = clEnqueueMapBuffer(g_cl_queue, job->c, CL_FALSE, CL_MAP_READ, 0, bytes_c, 0, NULL, &job->done, &err);
+    if (err != CL_SUCCESS) return err;
+    return clFlush(g_cl_queue);
+  }
+
+  // The result lands in a strided window of out: cols floats per row, row pitch
+  // b.rows. In blocks, each block's window is a.rows x block with pitch block.
+  size_t origin[3] = {0, 0, 0};
+  size_t width = block ? block : cols;
+  for (int j = 0; j < cols; j += width) {
+    size_t buffer_origin[3] = {j * sizeof(float), 0, 0};
+    size_t region[3] = {(cols - j < width ? cols - j : width) * sizeof(float), (size_t)a.rows, 1};
+    float* dst = block ? out.dat + (size_t)j * a.rows : out.dat;
+    err = clEnqueueReadBufferRect(g_cl_queue, job->c, CL_FALSE, buffer_origin, origin, region,
+                                  cols * sizeof(float), 0, (block ? block : b.rows) * sizeof(float), 0, dst,
+                                  0, NULL, j + width >= cols ? &job->done : NULL);
+    if (err != CL_SUCCESS) return err;
+  }
+  return clFlush(g_cl_queue);
+}
+
+// Wait for the job and free it. Returns the device time in seconds, taken from
+// the profiling info when the queue has it, or -1 if the job failed.
+double matmul_cl_finish(cl_matmul_job_t* job) {
+  double elapsed = -1;
+  if (job->done && clWaitForEvents(1, &job->done) == CL_SUCCESS) {
+    cl_ulong queued, end;
+    if (get_event_profiling_details(job->first, &queued, NULL, NULL, NULL) == CL_SUCCESS &&
+        get_event_profiling_details(job->done, NULL, NULL, NULL, &end) == CL_SUCCESS) {
+      elapsed = (end - queued) * 1e-9;
+    } else {
+      elapsed = now_seconds() - job->enqueued;
+    }
+  } else {
+    clFinish(g_cl_queue);
+  }
+  if (job->mapped) clEnqueueUnmapMemObject(g_cl_queue, job->c, job->mapped, 0, NULL, NULL);
+  if (job->first) clReleaseEvent(job->first);
+  if (job->done) clReleaseEvent(job->done);
+  if (job->a) clReleaseMemObject(job->a);
+  if (job->b && !job->weight) clReleaseMemObject(job->b);
+  if (job->c) clReleaseMemObject(job->c);
+  return elapsed;
+}
+
+// Heterogeneous CPU + OpenCL split.
+// On APUs neither the CPU nor the device is fast on its own, so with
+// GPT2_CL_SPLIT set the large products (logits, MLP, projections) are split by
+// output column: the device takes the first share of b's rows and the CPU
+// threads compute the rest while it runs. The share starts from a probe made
+// at load time and then follows the throughput measured on every call,
+// separately for each matmul shape.
+typedef struct {
+  int n, k, prefill;
+  float share;  // fraction of the output columns given to the device
+} split_ratio_t;
+
+split_ratio_t g_split_ratios[32];
+int g_num_split_ratios;
+float g_split_default = -1;  // < 0 while splitting is off
+
+split_ratio_t* split_ratio(Matrix a, Matrix b) {
+  LOOP(i, g_num_split_ratios) {
+    split_ratio_t* r = g_split_ratios + i;
+    if (r->n == b.rows && r->k == a.cols && r->prefill == (a.rows > 1)) return r;
+  }
+  if (g_num_split_ratios == 32) return NULL;
+  split_ratio_t r = {b.rows, a.cols, a.rows > 1, g_split_default};
+  g_split_ratios[g_num_split_ratios] = r;
+  return g_split_ratios + g_num_split_ratios++;
+}
+
+// Fold one measurement into the running share: each side's throughput is
+// columns per second, and the share that makes both finish together is the
+// device's fraction of the total.
+void split_update(split_ratio_t* r, int device_cols, double device_time, int cpu_cols, double cpu_time) {
+  if (device_time <= 0 || cpu_time <= 0) return;
+  double device_rate = device_cols / device_time, cpu_rate = cpu_cols / cpu_time;
+  float target = device_rate / (device_rate + cpu_rate);
+  r->share = .75 * r->share + .25 * target;
+  if (r->share < 1./16) r->share = 1./16;
+  if (r->share > 15./16) r->share = 15./16;
+}
+
+// Multiply a by transpose(b) on the device, the CPU, or both at once.
+// With block > 0 the columns of the product are cut into blocks of that
+// width and each block is stored as its own a.rows x block matrix, one after
+// the other; the result is returned as one (a.rows * b.rows/block) x block
+// matrix. For the qkv projection with block = 64 this is [3][NHEAD][T][64].
+// The epilogue e (may be NULL) is applied to every output, see epilogue_t.
+Matrix matmul_t_blocked(Matrix a, Matrix b, int block, const epilogue_t* e) {
+  Matrix out = block ? NewMatrix(a.rows * b.rows / block, block, 1) : NewMatrix(a.rows, b.rows, 1);
+
+  // Columns 0..device_cols go to the device, the rest to the CPU
+  int device_cols = g_cl_matmul.kernels[0] ? b.rows : 0;
+  split_ratio_t* ratio = NULL;
+  if (device_cols && g_split_default >= 0 && (double)a.rows * b.rows * a.cols >= 1 << 20 &&
+      (ratio = split_ratio(a, b))) {
+    device_cols = cl_round_up(ratio->share * b.rows, 16);
+    if (device_cols > b.rows) device_cols = b.rows;
+  }
+
+  cl_matmul_job_t job;
+  if (device_cols && matmul_cl_enqueue(a, b, device_cols, out, block, &job) != CL_SUCCESS) {
+    matmul_cl_finish(&job);
+    device_cols = 0;
+  }
+
+  double start = now_seconds();
+  matmul_cpu(a, b, out, device_cols, b.rows, block, e);
+  double cpu_time = now_seconds() - start;
+
+  if (device_cols) {
+    double device_time = matmul_cl_finish(&job);
+    if (device_time < 0) {
+      matmul_cpu(a, b, out, 0, device_cols, block, e);
+    } else {
+      // The device columns come back plain; one pass on the host finishes them
+      if (e) epilogue_apply(e, out, a.rows, b.rows, 0, device_cols, block);
+      if (ratio) split_update(ratio, device_cols, device_time, b.rows - device_cols, cpu_time);
+    }
+  }
+  return out;
+}
+
+Matrix matmul_t_fast(Matrix a, Matrix b) {
+  return matmul_t_blocked(a, b, 0, NULL);
+}
+
+// Probe both sides on a decode-shaped product with b (a weight matrix) to
+// pick the initial device share for GPT2_CL_SPLIT.
+void split_init(Matrix b) {
+  if (!getenv("GPT2_CL_SPLIT") || !g_cl_matmul.kernels[0]) return;
+
+  void* top = memory;
+  Matrix x = {b.dat, 1, b.cols, b.cols, 1};
+  Matrix out = NewMatrix(1, b.rows, 1);
+  cl_matmul_job_t job;
+  double device_time = -1;
+  // The first launch pays for kernel setup, so time the second one
+  LOOP(i, 2) {
+    if (matmul_cl_enqueue(x, b, b.rows, out, 0, &job) != CL_SUCCESS) {
+      matmul_cl_finish(&job);
+      device_time = -1;
+      break;
+    }
+    device_time = matmul_cl_finish(&job);
+  }
+  double start = now_seconds();
+  matmul_cpu(x, b, out, 0, b.rows, 0, NULL);
+  double cpu_time = now_seconds() - start;
+  memory = top;
+
+  if (device_time <= 0) return;
+  g_split_default = cpu_time / (cpu_time + device_time);
+  fprintf(stderr, "GPT2_CL_SPLIT: device %.3f ms, cpu %.3f ms, device share %.2f\n",
+          device_time * 1e3, cpu_time * 1e3, g_split_default);
+}
+
+// Launch t once on the tuning buffers and wait. Returns the wall time in
+// seconds, or -1 if the device refused it.
+double cl_tune_time(cl_tune_t t, cl_mem a, cl_mem b, cl_mem c, int M, int N, int K) {
+  size_t global[2], local[2];
+  cl_kernel kernel = cl_matmul_args(&g_cl_matmul, t, a, b, c, NULL, M, N, K, global, local);
+  double start = now_seconds();
+  if (clEnqueueNDRangeKernel(g_cl_queue, kernel, 2, NULL, global, local, 0, NULL, NULL) != CL_SUCCESS ||
+      clFinish(g_cl_queue) != CL_SUCCESS) {
+    return -1;
+  }
+  return now_seconds() - start;
+}
+
+// Free a shape's operands; any of them may be NULL
+void cl_tune_free(cl_mem a, cl_mem b, cl_mem c, float* host_a, float* host_b, float* host_c) {
+  if (a) clReleaseMemObject(a);
+  if (b) clReleaseMemObject(b);
+  if (c) clReleaseMemObject(c);
+  free(host_a);
+  free(host_b);
+  free(host_c);
+}
+
+// ./a.out --tune <model> sweeps the variants and work-group sizes over the
+// model's matmul shapes in every row bucket, checks each result against the
+// host, and writes the fastest to the device's profile. It runs on random
+// data, so the checkpoint is never read. Returns the exit code.
+int cl_tune_run() {
+  char path[1024], name[256] = "";
+  if (!g_cl_matmul.kernels[0] || cl_tune_path(g_cl_device, path, sizeof(path))) {
+    fprintf(stderr, "--tune: no OpenCL device, or GPT2_CL_TUNE is empty\n");
+    return 1;
+  }
+  clGetDeviceInfo(g_cl_device, CL_DEVICE_NAME, sizeof(name), name, NULL);
+  fprintf(stderr, "--tune: %s, max work-group %zu, local memory %lu bytes\n",
+          name, g_cl_matmul.max_group, (unsigned long)g_cl_matmul.local_mem);
+
+  // qkv, the two projections, the MLP up-projection and the logits (only
+  // ever computed for the last row); attention products are left to defaults
+  int shapes[][2] = {{3*DIM, DIM}, {DIM, DIM}, {4*DIM, DIM}, {DIM, 4*DIM}, {5e4, DIM}};
+  int buckets[] = {1, 32, 256};
+  cl_tune_t candidates[64], found[MAX_TUNE];
+  int num_candidates = 0, num_found = 0;
+  int sizes[] = {1, 2, 4, 8, 16, 32, 64, 128, 256};
+  LOOP(i, 5) LOOP(j, 5) {
+    cl_tune_t t = {0, 0, 0, MATMUL_NAIVE, {sizes[i], sizes[j+4]}};
+    candidates[num_candidates++] = t;
+  }
+  LOOP(i, 4) {
+    cl_tune_t t = {0, 0, 0, MATMUL_TILED, {sizes[i+2], sizes[i+2]}};
+    candidates[num_candidates++] = t;
+  }
+  LOOP(i, 6) {
+    cl_tune_t t = {0, 0, 0, MATMUL_REDUCE, {1, sizes[i+3]}};
+    candidates[num_candidates++] = t;
+  }
+
+  srand(1);
+  LOOP(s, 5) {
+    LOOP(bucket, 3) {
+      int M = buckets[bucket], N = shapes[s][0], K = shapes[s][1];
+      if (s == 4 && M > 1) continue;
+
+      cl_int err;
+      size_t bytes_a = (size_t)M * K * sizeof(float), bytes_b = (size_t)N * K * sizeof(float);
+      float *host_a = malloc(bytes_a), *host_b = malloc(bytes_b), *host_c = malloc((size_t)M * N * sizeof(float));
+      cl_mem a = NULL, b = NULL, c = NULL;
+      if (host_a && host_b && host_c) {
+        LOOP(i, M*K) host_a[i] = rand() / (float)RAND_MAX - .5;
+        for (size_t i = 0; i < (size_t)N*K; i++) host_b[i] = rand() / (float)RAND_MAX - .5;
+        a = clCreateBuffer(g_cl_context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, bytes_a, host_a, &err);
+        b = clCreateBuffer(g_cl_context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, bytes_b, host_b, &err);
+        c = clCreateBuffer(g_cl_context, CL_MEM_READ_WRITE, (size_t)M * N * sizeof(float), NULL, &err);
+      }
+      // Out of memory for this shape: skip it, and keep the ones done so far
+      if (!a || !b || !c) {
+        fprintf(stderr, "--tune: %4d x %5d x %4d: out of memory, skipped\n", M, N, K);
+        cl_tune_free(a, b, c, host_a, host_b, host_c);
+        continue;
+      }
+
+      cl_tune_t best = cl_tune_lookup(&g_cl_matmul, M, N, K);
+      double best_time = 1e9, default_time = -1;
+      LOOP(i, num_candidates + 1) {
+        // The last candidate is the untuned default, timed for comparison
+        cl_tune_t t = i < num_candidates ? candidates[i] : cl_tune_lookup(&g_cl_matmul, M, N, K);
+        if (!cl_tune_fits(&g_cl_matmul, t) || (t.variant == MATMUL_NAIVE && t.local[0] > M)) continue;
+
+        // The first run is the warm-up and the correctness check
+        double time = cl_tune_time(t, a, b, c, M, N, K);
+        if (time < 0 || clEnqueueReadBuffer(g_cl_queue, c, CL_TRUE, 0, (size_t)M * N * sizeof(float), host_c, 0, NULL, NULL) != CL_SUCCESS) continue;
+        int ok = 1;
+        LOOP(sample, 64) {
+          int row = rand() % M, col = rand() % N;
+          float expect = 0, scale = 0;
+          LOOP(k, K) {
+            expect += host_a[row*K + k] * host_b[(size_t)col*K + k];
+            scale += fabsf(host_a[row*K + k] * host_b[(size_t)col*K + k]);
+          }
+          ok &= fabsf(host_c[(size_t)row*N + col] - expect) <= 1e-4 * scale + 1e-6;
+        }
+        if (!ok) {
+          fprintf(stderr, "--tune: %s %dx%d gives wrong results, skipped\n", g_matmul_variant_names[t.variant], t.local[0], t.local[1]);
+          continue;
+        }
+        // Don't spend repeats on configurations that are clearly losing
+        if (time < 4 * best_time) {
+          LOOP(rep, 3) {
+            double again = cl_tune_time(t, a, b, c, M, N, K);
+            if (again >= 0 && again < time) time = again;
+          }
+        }
+        if (i == num_candidates) {
+          default_time = time;
+        } else if (time < best_time) {
+          best_time = time;
+          best = t;
+        }
+      }
+      best.m = M;
+      best.n = N;
+      best.k = K;
+      if (best_time < 1e9 && num_found < MAX_TUNE) found[num_found++] = best;
+      fprintf(stderr, "--tune: %4d x %5d x %4d: %s %dx%d %.3f ms (default %.3f ms)\n", M, N, K,
+              g_matmul_variant_names[best.variant], best.local[0], best.local[1], best_time * 1e3, default_time * 1e3);
+
+      cl_tune_free(a, b, c, host_a, host_b, host_c);
+    }
+  }
+
+  *strrchr(path, '/') = 0;
+  mkdir(path, 0755);
+  path[strlen(path)] = '/';
+  FILE* out = fopen(path, "w");
+  if (!out) {
+    fprintf(stderr, "--tune: can't write %s\n", path);
+    return 1;
+  }
+  fprintf(out, "# matmul tuning profile for %s\n# m n k variant lx ly\n", name);
+  LOOP(i, num_found) {
+    cl_tune_t* t = found + i;
+    fprintf(out, "%d %d %d %s %d %d\n", t->m, t->n, t->k, g_matmul_variant_names[t->variant], t->local[0], t->local[1]);
+  }
+  fclose(out);
+  fprintf(stderr, "--tune: wrote %s\n", path);
+  return 0;
+}
+
+// Take a slice out of a larger matrix and return a new matrix with the given shape
+// (a view of a, which is made dense first if it is not already)
+Matrix slice(Matrix a, int b, int rows, int cols) {
+  a = dense(a);
+  Matrix out = {a.dat + b*rows, rows, cols, cols, 1};
+  return out;
+}
+
+// A somewhat weird unary operator that computes the "layernorm" operator.
+// Exactly what it does doesn't matter.
+Matrix LayerNorm(Matrix a, int i) {
+  Matrix b = add(a, divide_const(sum(a), -a.cols));
+  Matrix k = divide_const(sum(multiply(add(NewMatrix(b.rows,b.cols,1),b), b)), b.cols-1); // todo can remove -1
+  Matrix out = add_tile(multiply_tile(multiply(add(NewMatrix(b.rows,b.cols,1),b), mat_isqrt(add_const(k, 1e-5),0)), layer_weights[i+1]), layer_weights[i]);
+
+  return out;
+}
+
+// Compute a linear matrix layer, x * W + b, followed by any further
+// epilogue_t fields given, e.g. Linear(x, 8, .gelu = 1)
+#define Linear(a, i, ...) matmul_t_blocked(a, layer_weights[i+1], 0, &(epilogue_t){layer_weights[i], __VA_ARGS__})
+
+// Parallel loading. read_matrix only notes where each matrix is in the file
+// (they are stored back to back, in the order they are read) and where it
+// goes; load_matrices then reads them all with pread from several threads,
+// in pieces of up to LOAD_PIECE bytes, so that loading runs at the speed of
+// the disk and not of one core.
+#define LOAD_PIECE (16 << 20)
+typedef struct {
+  char* dst;
+  off_t offset;
+  size_t bytes;
+} load_job_t;
+
+load_job_t* g_load_jobs;
+int g_num_load_jobs;
+off_t g_load_offset;       // where the next matrix starts in fp
+atomic_int g_load_next;    // next job to take
+atomic_int g_load_failed;
+
+// Read bytes at offset of fp into dst. Returns 0 on success.
+int pread_all(char* dst, size_t bytes, off_t offset) {
+  for (size_t done = 0; done < bytes;) {
+	ssize_t n = pread(fileno(fp), dst + done, bytes - done, offset + done);
+	if (n <= 0) return 1;
+	done += n;
+  }
+  return 0;
+}
+
+void* load_worker(void* arg) {
+  int i;
+  while ((i = atomic_fetch_add(&g_load_next, 1)) < g_num_load_jobs) {
+	load_job_t* job = g_load_jobs + i;
+	if (pread_all(job->dst, job->bytes, job->offset)) g_load_failed = 1;
+  }
+  return NULL;
+}
+
+// Read everything read_matrix has queued. Returns 0 on success.
+int load_matrices() {
+  int threads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (threads < 4) threads = 4;   // more reads in flight help even on few cores
+  if (threads > 32) threads = 32;
+  pthread_t workers[32];
+  g_load_next = g_load_failed = 0;
+  LOOP(i, threads) {
+	if (pthread_create(workers + i, NULL, load_worker, NULL)) threads = i;
+  }
+  load_worker(NULL);
+  LOOP(i, threads) pthread_join(workers[i], NULL);
+  free(g_load_jobs);
+  g_load_jobs = NULL;
+  g_num_load_jobs = 0;
+  return g_load_failed;
+}
+
+// Read a weight matrix out of the data file into memory
+// (queued: it is only there after load_matrices)
+Matrix read_matrix(int rows, int cols) {
+  rows+=!rows; // if rows == 0 then load at least one row
+  cols+=!cols; // if cols == 0 then load at least one col
+
+  // Every byte gets read, so there is no need to clear it first
+  Matrix a = NewMatrix(rows, cols, 0);
+
+  // It's already stored as a float on disk. Just load the bytes.
+  // (This assumes your machine is little endian)
+  for (size_t done = 0; done < (size_t)tmp; done += LOAD_PIECE) {
+	if (!(g_num_load_jobs & 255)) g_load_jobs = realloc(g_load_jobs, (g_num_load_jobs + 256) * sizeof(load_job_t));
+	load_job_t job = {(char*)a.dat + done, g_load_offset + done, tmp - done < LOAD_PIECE ? tmp - done : LOAD_PIECE};
+	g_load_jobs[g_num_load_jobs++] = job;
+  }
+  g_load_offset += tmp;
+
+  // Our matrix multiply assumes transposed weights (a view, so no copy).
+  return transpose(a);
+}
+
+// Skip over a weight matrix that stays on disk (see GPT2_STREAM): only its
+// shape is kept, with no data
+Matrix skip_matrix(int rows, int cols) {
+  rows+=!rows;
+  cols+=!cols;
+  g_load_offset += 4*rows*cols;
+  Matrix a = {NULL, rows, cols, cols, 1};
+  return transpose(a);
+}
+
+
+// The layers on disk are stored by sorting alphabetically,
+// because tensorflow makes no sense. We need to convert this to
+// the correct order. For example, if there are 12 layers, we would
+// have them on disk in order: 0 1 10 11 2 3 4 5 6 7 8 9
+// which means we permute by the inverse: 0 1 4 5 6 7 8 9 10 11 2 3
+int layer_index(int i) {
+  int permute = 0;
+  tmp=0;
+  LOOP(j, 10) {
+	if (j == i) {
+	  permute = tmp;
+	}
+	tmp++;
+	LOOP(k, 10*(j>0)) {
+	  if (j*10+k < NLAYER && tmp++ && i == j*10+k) {
+		permute = tmp;
+	  }
+	}
+  }
+  return permute;
+}
+
+// Paged key/value cache. The keys and values of every token a sequence
+// has been through the network with are kept, so the next pass only has
+// to run the tokens after them. They are stored in blocks of KV_BLOCK
+// tokens (all layers and heads of those tokens) taken from one pool that
+// every sequence in the process shares, and a sequence finds its tokens'
+// blocks through its block table. Forking a sequence copies just the
+// table and counts one more reference to each block; a block still shared
+// by two sequences is copied before either of them appends to it.
+#define KV_BLOCK 32
+#define KV_MAX_BLOCKS (1024 / KV_BLOCK)  // a full context
+
+typedef struct {
+  int len;                     // tokens cached
+  int tokens[1024];            // which they are
+  int blocks[KV_MAX_BLOCKS];   // token t is in blocks[t / KV_BLOCK]
+} kv_seq_t;
+
+// The pool: blocks are allocated as they are first needed, up to
+// GPT2_KV_BLOCKS of them, and kept on a free list once released
+char** g_kv_blocks;
+int* g_kv_refs;
+int* g_kv_free;
+int g_kv_num_free, g_kv_num_blocks, g_kv_max_blocks;
+size_t g_kv_block_bytes;
+
+// How the keys and values are stored. GPT2_KV=fp16 halves the cache and
+// GPT2_KV=int8 quarters it (a little more, for the scales): each token's
+// 64 values for a head are stored as bytes times one float scale, which
+// is its largest value / 127. Attention turns them back into floats as it
+// reads them.
+enum { KV_FP32, KV_FP16, KV_INT8 };
+int g_kv_type;
+size_t g_kv_rows;  // key and value rows of 64 per block: NLAYER * 2 * NHEAD * KV_BLOCK
+
+void kv_init() {
+  char *blocks = getenv("GPT2_KV_BLOCKS"), *type = getenv("GPT2_KV");
+  g_kv_max_blocks = blocks && atoi(blocks) > 0 ? atoi(blocks) : 4 * KV_MAX_BLOCKS;
+  g_kv_type = !type ? KV_FP32 : !strcmp(type, "fp16") ? KV_FP16 : !strcmp(type, "int8") ? KV_INT8 : KV_FP32;
+  if (type && g_kv_type == KV_FP32 && strcmp(type, "fp32")) {
+    fprintf(stderr, "GPT2_KV: unknown type %s, keeping fp32\n", type);
+  }
+  g_kv_rows = (size_t)NLAYER * 2 * NHEAD * KV_BLOCK;
+  g_kv_block_bytes = g_kv_rows * (g_kv_type == KV_FP32 ? 256 : g_kv_type == KV_FP16 ? 128 : 64 + sizeof(float));
+  g_kv_blocks = calloc(g_kv_max_blocks, sizeof(float*));
+  g_kv_refs = calloc(g_kv_max_blocks, sizeof(int));
+  g_kv_free = calloc(g_kv_max_blocks, sizeof(int));
+}
+
+// A free block, or -1 when the pool is used up
+int kv_alloc() {
+  int b;
+  if (g_kv_num_free) {
+	b = g_kv_free[--g_kv_num_free];
+  } else {
+	b = g_kv_num_blocks;
+	if (b == g_kv_max_blocks || !(g_kv_blocks[b] = aligned_alloc(64, g_kv_block_bytes))) {
+	  fprintf(stderr, "GPT2_KV_BLOCKS: out of key/value blocks (%d of %zu KB)\n", g_kv_max_blocks,
+			  g_kv_block_bytes >> 10);
+	  return -1;
+	}
+	g_kv_num_blocks++;
+  }
+  g_kv_refs[b] = 1;
+  return b;
+}
+
+void kv_unref(int b) {
+  if (!--g_kv_refs[b]) g_kv_free[g_kv_num_free++] = b;
+}
+
+#ifdef __F16C__
+#include<immintrin.h>
+#endif
+
+// Float <-> IEEE half, for when the CPU has no F16C instructions
+static inline unsigned short float_to_half(float f) {
+  unsigned u;
+  memcpy(&u, &f, 4);
+  unsigned sign = u >> 16 & 0x8000, mant = u & 0x7fffff;
+  int e = (u >> 23 & 0xff) - 112;
+  if (e >= 31) return sign | 0x7c00;                // too large (or inf/nan): inf
+  if (e <= 0) {                                     // subnormal, or zero
+	if (e < -10) return sign;
+	mant |= 0x800000;
+	unsigned half = mant >> (14 - e), rest = mant & ((1u << (14 - e)) - 1), mid = 1u << (13 - e);
+	return sign | (half + (rest > mid || (rest == mid && (half & 1))));
+  }
+  unsigned half = sign | e << 10 | mant >> 13, rest = mant & 0x1fff;
+  return half + (rest > 0x1000 || (rest == 0x1000 && (half & 1)));  // may round up into inf
+}
+
+static inline float half_to_float(unsigned short h) {
+  unsigned sign = (h & 0x8000) << 16, e = h >> 10 & 0x1f, mant = h & 0x3ff, u;
+  if (e == 31) {
+	u = sign | 0x7f800000 | mant << 13;
+  } else if (e) {
+	u = sign | (e + 112) << 23 | mant << 13;
+  } else {
+	float f = mant * 0x1p-24f;  // subnormal
+	return sign ? -f : f;
+  }
+  float f;
+  memcpy(&f, &u, 4);
+  return f;
+}
+
+// Where row r (see kv_put) of a block starts, and its scale for int8
+static inline char* kv_row(const kv_seq_t* seq, size_t r, int t) {
+  char* block = g_kv_blocks[seq->blocks[t / KV_BLOCK]];
+  return block + r * (g_kv_type == KV_FP32 ? 256 : g_kv_type == KV_FP16 ? 128 : 64);
+}
+
+static inline float* kv_scale(const kv_seq_t* seq, size_t r, int t) {
+  return (float*)(g_kv_blocks[seq->blocks[t / KV_BLOCK]] + g_kv_rows * 64) + r;
+}
+
+// The row of a block holding the key (which = 0) or value (which = 1) of
+// token t for one head of one layer
+static inline size_t kv_index(int layer, int which, int head, int t) {
+  return ((size_t)(layer*2 + which)*NHEAD + head)*KV_BLOCK + t % KV_BLOCK;
+}
+
+// Store the 64 floats x as that key or value
+void kv_put(const kv_seq_t* seq, int layer, int which, int head, int t, const float* x) {
+  size_t r = kv_index(layer, which, head, t);
+  char* row = kv_row(seq, r, t);
+  if (g_kv_type == KV_FP32) {
+	memcpy(row, x, 64*sizeof(float));
+  } else if (g_kv_type == KV_FP16) {
+	#ifdef __F16C__
+	for (int d = 0; d < 64; d += 8) {
+	  _mm_storeu_si128((__m128i*)(row + 2*d), _mm256_cvtps_ph(_mm256_loadu_ps(x + d), _MM_FROUND_TO_NEAREST_INT));
+	}
+	#else
+	LOOP(d, 64) ((unsigned short*)row)[d] = float_to_half(x[d]);
+	#endif
+  } else {
+	float max = 0;
+	LOOP(d, 64) max = fmaxf(max, fabsf(x[d]));
+	float scale = max / 127, inv = max ? 127 / max : 0;
+	LOOP(d, 64) ((signed char*)row)[d] = (signed char)lrintf(x[d] * inv);
+	*kv_scale(seq, r, t) = scale;
+  }
+}
+
+// The key or value as floats: a pointer into the block when it is stored as
+// floats, otherwise converted into buf
+static inline const float* kv_get(const kv_seq_t* seq, int layer, int which, int head, int t, float* buf) {
+  size_t r = kv_index(layer, which, head, t);
+  const char* row = kv_row(seq, r, t);
+  if (g_kv_type == KV_FP32) return (const float*)row;
+  if (g_kv_type == KV_FP16) {
+	#ifdef __F16C__
+	for (int d = 0; d < 64; d += 8) _mm256_storeu_ps(buf + d, _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(row + 2*d))));
+	#else
+	LOOP(d, 64) buf[d] = half_to_float(((const unsigned short*)row)[d]);
+	#endif
+  } else {
+	float scale = *kv_scale(seq, r, t);
+	LOOP(d, 64) buf[d] = ((const signed char*)row)[d] * scale;
+  }
+  return buf;
+}
+
+// Keep only the first len tokens
+void kv_seq_truncate(kv_seq_t* seq, int len) {
+  for (int i = (len + KV_BLOCK-1) / KV_BLOCK; i < (seq->len + KV_BLOCK-1) / KV_BLOCK; i++) kv_unref(seq->blocks[i]);
+  if (len < seq->len) seq->len = len;
+}
+
+void kv_seq_release(kv_seq_t* seq) {
+  kv_seq_truncate(seq, 0);
+}
+
+// dst (which must be empty) becomes a copy of src that shares its blocks
+void kv_seq_fork(kv_seq_t* dst, const kv_seq_t* src) {
+  *dst = *src;
+  LOOP(i, (src->len + KV_BLOCK-1) / KV_BLOCK) g_kv_refs[src->blocks[i]]++;
+}
+
+// Get seq ready to hold tokens[0..n): keep what it has of them (but at
+// least the last one is always run again, for its logits), and give it
+// blocks of its own to write the rest to. Returns the first token to run,
+// or -1 if the pool ran out, and then seq is left empty.
+int kv_seq_prepare(kv_seq_t* seq, const int* tokens, int n) {
+  int r0 = 0;
+  while (r0 < seq->len && r0 < n - 1 && seq->tokens[r0] == tokens[r0]) r0++;
+  kv_seq_truncate(seq, r0);
+  for (int i = r0 / KV_BLOCK; i < (n + KV_BLOCK-1) / KV_BLOCK; i++) {
+	int b = i * KV_BLOCK >= r0 || g_kv_refs[seq->blocks[i]] > 1 ? kv_alloc() : seq->blocks[i];
+	if (b < 0) {
+	  // Give back every block seq holds, up to the one that failed
+	  seq->len = i * KV_BLOCK > r0 ? i * KV_BLOCK : r0;
+	  kv_seq_release(seq);
+	  return -1;
+	}
+	if (i * KV_BLOCK >= r0) {
+	  seq->blocks[i] = b;
+	} else if (b != seq->blocks[i]) {
+	  // Copy on write: the first tokens of this block are someone else's too
+	  memcpy(g_kv_blocks[b], g_kv_blocks[seq->blocks[i]], g_kv_block_bytes);
+	  kv_unref(seq->blocks[i]);
+	  seq->blocks[i] = b;
+	}
+  }
+  memcpy(seq->tokens + r0, tokens + r0, (n - r0) * sizeof(int));
+  seq->len = n;
+  return r0;
+}
+
+static inline float dot64(const float* a, const float* b) {
+  vfloat acc = v_set(0);
+  for (int d = 0; d < 64; d += VW) acc = v_fma(v_load(a + d), v_load(b + d), acc);
+  float t[VW], s = 0;
+  v_store(t, acc);
+  LOOP(i, VW) s += t[i];
+  return s;
+}
+
+// One head of one layer's attention for the query q of token t: the
+// softmax of its scores against the keys of tokens 0..t, times their
+// values, into out. The keys and values are read in place in their blocks
+// (and converted to floats on the way, if they are stored smaller).
+void attention_row(const float* q, const kv_seq_t* seq, int layer, int head, int t, float* out) {
+  float s[1024], buf[64], max = -INFINITY, sum = 0;
+  LOOP(j, t + 1) {
+	s[j] = dot64(q, kv_get(seq, layer, 0, head, j, buf)) / 8;
+	if (s[j] > max) max = s[j];
+  }
+  LOOP(j, t + 1) s[j] -= max;
+  exp_array(s, t + 1, 1);
+  LOOP(j, t + 1) sum += s[j];
+  LOOP(j, t + 1) {
+	const float* v = kv_get(seq, layer, 1, head, j, buf);
+	float p = s[j] / sum;
+	LOOP(d, 64) out[d] += p * v[d];
+  }
+}
+
+// Run one transformer layer (the one layer_weights points at, layer
+// number `layer`) over the rows of tokens r0..r1, which are at rows, in
+// place. The tokens before r0 have been through this layer already, and
+// their keys and values are in seq; the new rows' are added to it, so the
+// layer can be run over the rows in chunks.
+void layer_forward(float* rows, int r0, int r1, kv_seq_t* seq, int layer) {
+  int n = r1 - r0;
+  Matrix x = {rows, n, DIM, DIM, 1};
+
+  // Compute the keys, queries, and values all at once with a big multiply,
+  // stored head-major ([3][NHEAD][n][64]) so that every head's query, key
+  // and value matrix is a plain n x 64 slice of qkv
+  double span = trace_begin();
+  Matrix ln = LayerNorm(x, 4);
+  span = trace_end("LayerNorm", -1, span);
+  Matrix qkv = matmul_t_blocked(ln, layer_weights[1], 64, &(epilogue_t){layer_weights[0]});
+  LOOP(k, 2*NHEAD) {
+	LOOP(t, n) {
+	  kv_put(seq, layer, k / NHEAD, k % NHEAD, r0 + t, qkv.dat + ((NHEAD + k)*n + t)*64);
+	}
+  }
+  span = trace_end("QKV", -1, span);
+
+  // Make space for the output of the computation, already in the n x DIM
+  // layout the projection below reads, and fill in each head's columns,
+  // up to 16 rows of one head at a time (one span each in a trace)
+  Matrix result = NewMatrix(n, DIM, 1);
+  int blocks = (n + 15) / 16;
+  #ifdef GOFAST
+  #pragma omp parallel for
+  #endif
+  LOOP(i, NHEAD*blocks) {
+	int k = i / blocks, t0 = i % blocks * 16, t1 = t0 + 16 < n ? t0 + 16 : n;
+	double head = trace_begin();
+	for (int t = t0; t < t1; t++) {
+	  attention_row(qkv.dat + (k*n + t)*64, seq, layer, k, r0 + t, result.dat + t*DIM + 64*k);
+	}
+	trace_end("head", k, head);
+  }
+  span = trace_end("attention", -1, span);
+
+  // Residual connection
+  x = Linear(result, 2, .residual = x);
+  span = trace_end("attention proj", -1, span);
+
+  // Activation function and residual connection
+  ln = LayerNorm(x, 6);
+  span = trace_end("LayerNorm", -1, span);
+  x = Linear(Linear(ln, 8, .gelu = 1), 10, .residual = x);
+  trace_end("MLP", -1, span);
+  memcpy(rows, x.dat, n*DIM*sizeof(float));
+}
+
+// Pipeline-parallel layers. With GPT2_STAGES=S the layers are cut into S
+// stages of consecutive layers, each run by its own thread (and, with
+// GOFAST, its own group of OpenMP threads pinned to its share of the
+// cores), so every core only ever streams its stage's weights, which can
+// stay in its caches. The rows are fed through in chunks of STAGE_CHUNK:
+// a stage takes a chunk from its input queue, runs it through all of its
+// layers, and hands it on to the next stage, so all the stages work at
+// once on different chunks. Chunks arrive at a stage in order, so the
+// keys and values of the earlier rows are always there for the attention.
+#define STAGE_CHUNK 32
+#define QUEUE_SIZE 64  // more than 1024 / STAGE_CHUNK, so a push never waits
+
+// One chunk of rows on its way through the stages
+typedef struct {
+  float* line;  // the rows of tokens r0..r1
+  kv_seq_t* seq;
+  int r0, r1;
+} chunk_t;
+
+// Lock-free single-producer single-consumer ring of chunks
+typedef struct {
+  chunk_t items[QUEUE_SIZE];
+  _Alignas(64) _Atomic unsigned head;  // next to pop, written by the consumer
+  _Alignas(64) _Atomic unsigned tail;  // next to push, written by the producer
+} spsc_t;
+
+// Spin for a while, then sleep, so idle stages don't hold on to a core
+void spsc_wait(int* spins) {
+  if (++*spins < 1000) {
+	sched_yield();
+  } else {
+	struct timespec ts = {0, 50000};
+	nanosleep(&ts, NULL);
+  }
+}
+
+void spsc_push(spsc_t* q, chunk_t c) {
+  unsigned tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+  int spins = 0;
+  while (tail - atomic_load_explicit(&q->head, memory_order_acquire) == QUEUE_SIZE) spsc_wait(&spins);
+  q->items[tail % QUEUE_SIZE] = c;
+  atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+}
+
+chunk_t spsc_pop(spsc_t* q) {
+  unsigned head = atomic_load_explicit(&q->head, memory_order_relaxed);
+  int spins = 0;
+  while (atomic_load_explicit(&q->tail, memory_order_acquire) == head) spsc_wait(&spins);
+  chunk_t c = q->items[head % QUEUE_SIZE];
+  atomic_store_explicit(&q->head, head + 1, memory_order_release);
+  return c;
+}
+
+typedef struct {
+  int layer0, layer1;    // the layers this stage runs
+  int cpu0, cpus;        // the cores its thread group is pinned to
+  Matrix* weights;
+  spsc_t* in, *out;
+  void* arena;
+} stage_t;
+
+#define MAX_STAGES 16
+stage_t g_stages[MAX_STAGES];
+spsc_t g_stage_queues[MAX_STAGES + 1];  // queue s feeds stage s; the last one returns to forward
+int g_num_stages;
+
+void* stage_main(void* arg) {
+  stage_t* st = arg;
+  int layers = st->layer1 - st->layer0;
+
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  LOOP(c, st->cpus) CPU_SET(st->cpu0 + c, &set);
+  sched_setaffinity(0, sizeof(set), &set);
+  #ifdef GOFAST
+  omp_set_num_threads(st->cpus);
+  #endif
+
+  while (1) {
+	chunk_t c = spsc_pop(st->in);
+	LOOP(i, layers) {
+	  memory = st->arena;
+	  layer_weights = st->weights + 12*layer_index(st->layer0 + i);
+	  double span = trace_begin();
+	  layer_forward(c.line, c.r0, c.r1, c.seq, st->layer0 + i);
+	  trace_end("layer", st->layer0 + i, span);
+	}
+	spsc_push(st->out, c);
+  }
+  return NULL;
+}
+
+// Start the stage threads if GPT2_STAGES asks for them. They share the
+// CPUs, and need the OpenMP matmul on the host (not the OpenCL one, whose
+// queue and kernels are not safe to share between threads).
+void stages_init(Matrix* weights) {
+  char* stages = getenv("GPT2_STAGES");
+  int S = stages ? atoi(stages) : 0, cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  if (S < 2) return;
+  if (!weights[0].dat) {  // the layers are streamed from disk
+	fprintf(stderr, "GPT2_STAGES: not used with GPT2_STREAM\n");
+	return;
+  }
+  if (S > NLAYER) S = NLAYER;
+  if (S > MAX_STAGES) S = MAX_STAGES;
+  if (g_cl_matmul.kernels[0]) {
+	fprintf(stderr, "GPT2_STAGES: not used with an OpenCL device\n");
+	return;
+  }
+
+  // The largest chunk's temporaries (the keys and values are in the
+  // sequence's blocks)
+  size_t bytes = (size_t)STAGE_CHUNK * 64*DIM * sizeof(float);
+  LOOP(s, S) {
+	stage_t* st = g_stages + s;
+	st->layer0 = s * NLAYER / S;
+	st->layer1 = (s + 1) * NLAYER / S;
+	st->cpu0 = cpus < S ? 0 : s * cpus / S;
+	st->cpus = cpus < S ? cpus : (s + 1) * cpus / S - st->cpu0;
+	st->weights = weights;
+	st->in = g_stage_queues + s;
+	st->out = g_stage_queues + s + 1;
+	st->arena = aligned_alloc(4096, cl_round_up(bytes, 4096));
+	pthread_t thread;
+	if (!st->arena || pthread_create(&thread, NULL, stage_main, st)) {
+	  fprintf(stderr, "GPT2_STAGES: could not start stage %d\n", s);
+	  exit(1);
+	}
+	pthread_detach(thread);
+  }
+  g_num_stages = S;
+  fprintf(stderr, "GPT2_STAGES: %d stages of %d-%d layers\n", S, NLAYER/S, (NLAYER + S - 1)/S);
+}
+
+// Layer streaming. With GPT2_STREAM=W only W layers' weights are held in
+// memory at once, so models larger than the RAM still run, at the speed
+// the disk can deliver their layers. The layers are left in the checkpoint
+// (main only notes their shapes with skip_matrix) and W slots take them in
+// turn: a prefetch thread reads the next layers into the free slots with
+// pread while the current one runs, and each slot is freed (and refilled
+// with the layer W further on) as soon as its layer is done. Every pass
+// reads all the layers again; the host path is the only one that streams.
+#define MAX_STREAM 16
+int g_stream;                      // W, or 0 when everything is loaded
+int g_stream_started;
+Matrix g_stream_slots[MAX_STREAM][12];
+_Atomic int g_stream_ready[MAX_STREAM];  // 1 + the layer in the slot, 0 when free
+off_t g_stream_layer_bytes;
+int g_stream_next;                 // slots handed out so far, by stream_layer
+
+void* stream_main(void* arg) {
+  for (int k = 0;; k++) {
+	int s = k % g_stream, spins = 0;
+	while (atomic_load_explicit(g_stream_ready + s, memory_order_acquire)) spsc_wait(&spins);
+	// The checkpoint starts with the layers, in their order on disk
+	off_t offset = layer_index(k % NLAYER) * g_stream_layer_bytes;
+	double span = trace_begin();
+	LOOP(j, 12) {
+	  Matrix w = g_stream_slots[s][j];
+	  size_t bytes = 4 * (size_t)w.rows * w.cols;
+	  if (pread_all((char*)w.dat, bytes, offset)) {
+		fprintf(stderr, "GPT2_STREAM: failed to read layer %d\n", k % NLAYER);
+		exit(1);
+	  }
+	  offset += bytes;
+	}
+	trace_end("read layer", k % NLAYER, span);
+	atomic_store_explicit(g_stream_ready + s, k % NLAYER + 1, memory_order_release);
+  }
+  return NULL;
+}
+
+// Make the slots, shaped like the layers skip_matrix passed over
+void stream_init(Matrix* weights) {
+  char* stream = getenv("GPT2_STREAM");
+  g_stream = stream ? atoi(stream) : 0;
+  if (g_stream > MAX_STREAM) g_stream = MAX_STREAM;
+  if (g_stream < 1) g_stream = 0;
+  LOOP(s, g_stream) {
+	LOOP(j, 12) {
+	  Matrix w = weights[j];
+	  g_stream_slots[s][j] = transpose(NewMatrix(w.cols, w.rows, 0));
+	  if (!s) g_stream_layer_bytes += 4 * (off_t)w.rows * w.cols;
+	}
+  }
+}
+
+// The weights of layer i (the next one in order): wait until it is in its slot
+Matrix* stream_layer(int i) {
+  // Started here, so a GPT2_SERVE worker runs its own after the fork
+  if (!g_stream_started) {
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, stream_main, NULL)) {
+	  fprintf(stderr, "GPT2_STREAM: could not start the prefetch thread\n");
+	  exit(1);
+	}
+	pthread_detach(thread);
+	g_stream_started = 1;
+  }
+  int s = g_stream_next % g_stream, spins = 0;
+  while (atomic_load_explicit(g_stream_ready + s, memory_order_acquire) != i + 1) spsc_wait(&spins);
+  return g_stream_slots[s];
+}
+
+// The layer stream_layer last returned is done: free its slot for the
+// prefetch thread
+void stream_done() {
+  atomic_store_explicit(g_stream_ready + g_stream_next++ % g_stream, 0, memory_order_release);
+}
+
+int g_prefill_chunk = 64;  // GPT2_PREFILL_CHUNK, 0 for all the rows at once
+
+// The token embedding plus the position encoding of tokens r0..r1, into rows
+void embed(float* rows, Matrix wpe, Matrix wte, int* history_tokens, int r0, int r1) {
+  for (int i = r0; i < r1; i++) {
+	LOOP(j, DIM) {
+	  rows[(i-r0)*DIM+j] = AT(wte, history_tokens[i], j) + AT(wpe, j, i);
+	}
+  }
+}
+
+// Run the transformer over the tokens in the history that seq does not
+// hold yet and return the last one's final hidden state (1 x DIM), or no
+// matrix (dat NULL) if there are no key/value blocks left for them.
+Matrix forward_hidden(Matrix* weights, Matrix wpe, Matrix wte, int* history_tokens, kv_seq_t* seq) {
+  int n = num_total_tokens, r0 = kv_seq_prepare(seq, history_tokens, n);
+  if (r0 < 0) return (Matrix){0};
+  // The hidden state of the last token, once it has been through
+  float* last_row = NULL;
+
+  // Start the transformer neural network inference.
+  if (g_num_stages) {
+	// The stages hold all the new rows at once: embed them, feed them to the
+	// first stage in chunks and wait for them out of the last
+	Matrix line = NewMatrix(n - r0, DIM, 1);
+	embed(line.dat, wpe, wte, history_tokens, r0, n);
+	for (int c0 = r0; c0 < n; c0 += STAGE_CHUNK) {
+	  chunk_t c = {line.dat + (c0-r0)*DIM, seq, c0, c0 + STAGE_CHUNK < n ? c0 + STAGE_CHUNK : n};
+	  spsc_push(g_stage_queues, c);
+	}
+	for (int c0 = r0; c0 < n; c0 += STAGE_CHUNK) spsc_pop(g_stage_queues + g_num_stages);
+	last_row = line.dat + (n-1-r0)*DIM;
+  } else {
+	// Chunked prefill: a long prompt goes through all the layers
+	// GPT2_PREFILL_CHUNK rows at a time (each chunk's keys and values are
+	// in seq for the next). Only the chunk's rows are embedded and kept, and
+	// every layer's temporaries are dropped as soon as it is done, so the
+	// activations take the same memory however long the prompt is.
+	// Streamed layers are read once for all the rows.
+	int chunk = g_prefill_chunk && !g_stream && g_prefill_chunk < n - r0 ? g_prefill_chunk : n - r0;
+	Matrix line = NewMatrix(chunk, DIM, 1);
+	void* top = memory;
+	for (int c0 = r0; c0 < n; c0 += chunk) {
+	  int c1 = c0 + chunk < n ? c0 + chunk : n;
+	  embed(line.dat, wpe, wte, history_tokens, c0, c1);
+	  LOOP(i, NLAYER) {
+		memory = top;
+		// This layer's weights are at this offset (or on their way from disk)
+		double span = trace_begin();
+		layer_weights = g_stream ? stream_layer(i) : weights + 12*layer_index(i);
+		layer_forward(line.dat, c0, c1, seq, i);
+		if (g_stream) stream_done();
+		trace_end("layer", i, span);
+	  }
+	  last_row = line.dat + (c1-1-c0)*DIM;
+	}
+	memory = top;
+  }
+
+  // Reset layer weights so we can do the last layer norm
+  layer_weights = weights;
+  Matrix last = {last_row, 1, DIM, DIM, 1};
+  double span = trace_begin();
+  last = LayerNorm(last, 12*NLAYER);
+  trace_end("LayerNorm", -1, span);
+  return last;
+}
+
+// The logits of the last hidden state
+Matrix logits_of(Matrix hidden, Matrix wte) {
+  double span = trace_begin();
+  Matrix logits = matmul_t_fast(hidden, wte);
+  trace_end("logits", -1, span);
+  return logits;
+}
+
+// The same, all the way to the logits for the token that comes next
+Matrix forward(Matrix* weights, Matrix wpe, Matrix wte, int* history_tokens, kv_seq_t* seq) {
+  Matrix hidden = forward_hidden(weights, wpe, wte, history_tokens, seq);
+  if (!hidden.dat) return hidden;
+  return logits_of(hidden, wte);
+}
+
+// Top k. The next token is picked from the k largest logits (k = 1 for
+// greedy decoding), and finding those needs no sort of all 50k: each thread
+// keeps its best k in a sorted list while it scans its share of the
+// logits, comparing VW of them at once against the worst of the k, so
+// almost every logit costs one vector compare. The lists are then merged.
+// Ties go to the lower id, as a plain argmax scan would pick.
+#define TOPK_MAX 32      // as in test/matrix_kernels.cl
+#define TOPK_GROUP 64    // work-group size of the topk kernel, also as there
+#define TOPK_GROUPS 64   // work-groups in its first stage
+typedef struct {
+  int k;
+  int id[TOPK_MAX];        // best first
+  float logit[TOPK_MAX];
+} topk_t;
+
+#define TOPK_BETTER(v, i, w, j) ((v) > (w) || ((v) == (w) && (i) < (j)))
+
+void topk_init(topk_t* t, int k) {
+  t->k = k;
+  LOOP(j, k) {
+	t->id[j] = 1 << 30;
+	t->logit[j] = -INFINITY;
+  }
+}
+
+void topk_insert(topk_t* t, float v, int id) {
+  int j = t->k - 1;
+  if (!TOPK_BETTER(v, id, t->logit[j], t->id[j])) return;
+  for (; j > 0 && TOPK_BETTER(v, id, t->logit[j-1], t->id[j-1]); j--) {
+	t->id[j] = t->id[j-1];
+	t->logit[j] = t->logit[j-1];
+  }
+  t->id[j] = id;
+  t->logit[j] = v;
+}
+
+void topk_scan(const float* x, int i0, int i1, topk_t* t) {
+  int i = i0;
+  for (; i + VW <= i1; i += VW) {
+	for (int m = v_gt_mask(v_load(x + i), v_set(t->logit[t->k - 1])); m; m &= m - 1) {
+	  topk_insert(t, x[i + __builtin_ctz(m)], i + __builtin_ctz(m));
+	}
+  }
+  for (; i < i1; i++) topk_insert(t, x[i], i);
+}
+
+// The k (at most TOPK_MAX) largest of x[0..n)
+void topk(const float* x, int n, int k, topk_t* out) {
+  topk_init(out, k);
+  #ifdef GOFAST
+  #pragma omp parallel
+  {
+	int c = omp_get_thread_num(), C = omp_get_num_threads();
+	topk_t t;
+	topk_init(&t, k);
+	topk_scan(x, (long)n*c/C, (long)n*(c+1)/C, &t);
+	#pragma omp critical
+	LOOP(j, k) topk_insert(out, t.logit[j], t.id[j]);
+  }
+  #else
+  topk_scan(x, 0, n, out);
+  #endif
+}
+
+// The top k of the logits of hidden on the plain device, without
+// GPT2_CL_PIPELINE: the logits product stays in a device buffer and the two
+// stages of the topk kernel (see cl_pipeline_topk) reduce it there, so only
+// the k (id, logit) pairs are read back. Any failure leaves the caller to
+// compute the logits on the host.
+cl_int cl_logits_topk(Matrix hidden, Matrix wte, int k, topk_t* out) {
+  cl_int err = CL_SUCCESS;
+  if (!g_cl_matmul.kernels[0] || g_split_default >= 0) return CL_INVALID_OPERATION;
+  if (!g_cl_topk) {
+	size_t sizes[] = {TOPK_GROUPS*TOPK_MAX, TOPK_MAX};
+	g_cl_topk = clCreateKernel(g_cl_program, "topk", &err);
+	LOOP(stage, 2) {
+	  if (err == CL_SUCCESS) g_cl_top_vals[stage] = clCreateBuffer(g_cl_context, CL_MEM_READ_WRITE, sizes[stage] * sizeof(float), NULL, &err);
+	  if (err == CL_SUCCESS) g_cl_top_ids[stage] = clCreateBuffer(g_cl_context, CL_MEM_READ_WRITE, sizes[stage] * sizeof(int), NULL, &err);
+	}
+	if (err != CL_SUCCESS) {
+	  cl_topk_release();
+	  return err;
+	}
+  }
+
+  double span = trace_begin();
+  Matrix none = {NULL, hidden.rows, wte.rows, wte.rows, 1};
+  cl_matmul_job_t job;
+  err = matmul_cl_enqueue(hidden, wte, wte.rows, none, 0, &job);
+  cl_mem empty = NULL;
+  cl_uint kk = k;
+  LOOP(stage, 2) {
+	if (err != CL_SUCCESS) break;
+	cl_uint n = stage ? TOPK_GROUPS * kk : (cl_uint)wte.rows;
+	clSetKernelArg(g_cl_topk, 0, sizeof(cl_mem), stage ? g_cl_top_vals : &job.c);
+	clSetKernelArg(g_cl_topk, 1, sizeof(cl_mem), stage ? g_cl_top_ids : &empty);
+	clSetKernelArg(g_cl_topk, 2, sizeof(cl_uint), &n);
+	clSetKernelArg(g_cl_topk, 3, sizeof(cl_uint), &kk);
+	clSetKernelArg(g_cl_topk, 4, sizeof(cl_mem), g_cl_top_vals + stage);
+	clSetKernelArg(g_cl_topk, 5, sizeof(cl_mem), g_cl_top_ids + stage);
+	clSetKernelArg(g_cl_topk, 6, TOPK_GROUP * TOPK_MAX * sizeof(float), NULL);
+	clSetKernelArg(g_cl_topk, 7, TOPK_GROUP * TOPK_MAX * sizeof(int), NULL);
+	size_t global = stage ? TOPK_GROUP : TOPK_GROUP * TOPK_GROUPS, local = TOPK_GROUP;
+	cl_event ev;
+	// The queue is in order, so each stage follows the product
+	err = clEnqueueNDRangeKernel(g_cl_queue, g_cl_topk, 1, NULL, &global, &local, 0, NULL, &ev);
+	if (err != CL_SUCCESS) break;
+	trace_cl(0, ev, g_cl_topk, NULL);
+	clReleaseEvent(ev);
+  }
+  out->k = k;
+  if (err == CL_SUCCESS) err = clEnqueueReadBuffer(g_cl_queue, g_cl_top_vals[1], CL_FALSE, 0, k * sizeof(float), out->logit, 0, NULL, NULL);
+  if (err == CL_SUCCESS) err = clEnqueueReadBuffer(g_cl_queue, g_cl_top_ids[1], CL_TRUE, 0, k * sizeof(int), out->id, 0, NULL, NULL);
+  matmul_cl_finish(&job);
+  trace_end("logits", -1, span);
+  return err;
+}
+
+// Sampling. By default the next token is the arg-max. With
+// GPT2_TEMPERATURE=t it is drawn from softmax(logits / t) instead, cut to
+// the GPT2_TOP_K most likely tokens and then to the fewest of those that
+// hold GPT2_TOP_P of the probability (nucleus sampling). GPT2_SEED makes
+// the draws repeatable: every chat starts the generator from it.
+//
+// None of this sorts the vocabulary. A top k of at most TOPK_MAX comes
+// straight from topk() (or the device). Otherwise one parallel pass
+// buckets the logits by how far they are below the largest and sums the
+// probability in each bucket; walking the buckets from the top finds the
+// one where the top k or top p cut falls. Everything above it is kept
+// as is, and only the few logits in that bucket get sorted.
+#define SAMPLE_BUCKETS 1024
+#define SAMPLE_RANGE 32.f  // in units of t; anything further below the max shares the last bucket
+
+typedef struct {
+  float temperature;  // 0 for greedy
+  int top_k;          // 0 for no limit
+  float top_p;        // 1 for no limit
+  int seeded;
+  unsigned long long state;
+} sampler_t;
+
+sampler_t g_sampler;
+
+void sampler_init() {
+  char *t = getenv("GPT2_TEMPERATURE"), *k = getenv("GPT2_TOP_K"), *p = getenv("GPT2_TOP_P"), *seed = getenv("GPT2_SEED");
+  g_sampler.temperature = t ? atof(t) : 0;
+  g_sampler.top_k = k ? atoi(k) : 0;
+  g_sampler.top_p = p ? atof(p) : 1;
+  g_sampler.seeded = seed != NULL;
+  g_sampler.state = seed ? strtoull(seed, NULL, 0) : 0;
+  if (g_sampler.temperature < 0 || g_sampler.top_k < 0 || g_sampler.top_p <= 0) {
+    fprintf(stderr, "GPT2_TEMPERATURE, GPT2_TOP_K and GPT2_TOP_P must be positive, using greedy decoding\n");
+    g_sampler.temperature = 0;
+  }
+}
+
+// A chat's own generator: from GPT2_SEED, or else from the clock and pid
+sampler_t sampler_for_chat() {
+  sampler_t s = g_sampler;
+  if (!s.seeded) s.state = (unsigned long long)(now_seconds() * 1e9) ^ (unsigned long long)getpid() << 32;
+  return s;
+}
+
+// Uniform in [0, 1), from splitmix64
+double sample_uniform(sampler_t* s) {
+  unsigned long long z = s->state += 0x9e3779b97f4a7c15ull;
+  z = (z ^ z >> 30) * 0xbf58476d1ce4e5b9ull;
+  z = (z ^ z >> 27) * 0x94d049bb133111ebull;
+  return ((z ^ z >> 31) >> 11) * 0x1p-53;
+}
+
+// How many candidates the logits have to be reduced to before sample_top:
+// 1 when greedy, 0 when sample needs all of them.
+int sampler_candidates(const sampler_t* s) {
+  if (s->temperature <= 0) return 1;
+  return s->top_k <= TOPK_MAX ? s->top_k : 0;
+}
+
+// The index picked by u in [0, 1) from weights w[0..n), scaled to sum
+int sample_index(const float* w, int n, double sum, double u) {
+  double target = u * sum;
+  LOOP(i, n - 1) {
+	if ((target -= w[i]) < 0) return i;
+  }
+  return n - 1;
+}
+
+// Draw from the best first candidates in top (as many as top_k asks for):
+// apply the temperature, then the top p cut.
+int sample_top(sampler_t* s, const topk_t* top) {
+  if (s->temperature <= 0) return top->id[0];
+  float w[TOPK_MAX];
+  double sum = 0;
+  int n = top->k;
+  LOOP(j, n) {
+	w[j] = top->logit[j] - top->logit[0];
+  }
+  exp_array(w, n, 1 / s->temperature);
+  LOOP(j, n) sum += w[j];
+  // The nucleus: the fewest, best first, that hold top_p of the sum
+  double mass = 0, keep = s->top_p * sum;
+  LOOP(j, n) {
+	mass += w[j];
+	if (mass >= keep) {
+	  n = j + 1;
+	  sum = mass;
+	  break;
+	}
+  }
+  return top->id[sample_index(w, n, sum, sample_uniform(s))];
+}
+
+typedef struct {
+  int id;
+  float logit;
+} candidate_t;
+
+// Best first, ties to the lower id
+int candidate_cmp(const void* a, const void* b) {
+  const candidate_t *x = a, *y = b;
+  return TOPK_BETTER(x->logit, x->id, y->logit, y->id) ? -1 : TOPK_BETTER(y->logit, y->id, x->logit, x->id);
+}
+
+// The bucket of a logit: how far it is below the max, in 1/scale steps
+static inline int sample_bucket(float v, float max, float scale) {
+  float d = (max - v) * scale;
+  return d < SAMPLE_BUCKETS ? (int)d : SAMPLE_BUCKETS;
+}
+
+// The logits of x[0..n) in buckets b0..b1, in id order, into c (at most max_c)
+int sample_bucket_ids(const float* x, int n, float max, float scale, int b0, int b1, candidate_t* c, int max_c) {
+  int k = 0, i = 0;
+  float edge = b1 < SAMPLE_BUCKETS ? max - (b1 + 2) / scale : -INFINITY;  // a bucket early, for rounding
+  for (; i + VW <= n; i += VW) {
+	for (int m = v_gt_mask(v_load(x + i), v_set(edge)); m; m &= m - 1) {
+	  int j = i + __builtin_ctz(m), b = sample_bucket(x[j], max, scale);
+	  if (b >= b0 && b <= b1 && k < max_c) c[k++] = (candidate_t){j, x[j]};
+	}
+  }
+  for (; i < n; i++) {
+	int b = sample_bucket(x[i], max, scale);
+	if (x[i] > edge && b >= b0 && b <= b1 && k < max_c) c[k++] = (candidate_t){i, x[i]};
+  }
+  return k;
+}
+
+// Draw the next token from the logits x[0..n)
+int sample(sampler_t* s, const float* x, int n) {
+  topk_t top;
+  int k = sampler_candidates(s);
+  if (k) {
+	topk(x, n, k, &top);
+	return sample_top(s, &top);
+  }
+  topk(x, n, 1, &top);
+  float max = top.logit[0], t = s->temperature, scale = SAMPLE_BUCKETS / (SAMPLE_RANGE * t);
+
+  // Count and weigh the logits in each bucket (the last holds the rest)
+  int count[SAMPLE_BUCKETS + 1] = {0};
+  double mass[SAMPLE_BUCKETS + 1] = {0};
+  #ifdef GOFAST
+  #pragma omp parallel
+  #endif
+  {
+	int c = 0, C = 1;
+	#ifdef GOFAST
+	c = omp_get_thread_num(), C = omp_get_num_threads();
+	#endif
+	int my_count[SAMPLE_BUCKETS + 1] = {0};
+	double my_mass[SAMPLE_BUCKETS + 1] = {0};
+	float w[256];
+	for (int i = (long)n*c/C, end = (long)n*(c+1)/C; i < end; i += 256) {
+	  int len = end - i < 256 ? end - i : 256;
+	  LOOP(j, len) w[j] = x[i + j] - max;
+	  exp_array(w, len, 1 / t);
+	  LOOP(j, len) {
+		int b = sample_bucket(x[i + j], max, scale);
+		my_count[b]++;
+		my_mass[b] += w[j];
+	  }
+	}
+	// Added up in thread order, so that a seed always gives the same tokens
+	#ifdef GOFAST
+	#pragma omp for ordered schedule(static, 1)
+	#endif
+	LOOP(r, C) {
+	  #ifdef GOFAST
+	  #pragma omp ordered
+	  #endif
+	  LOOP(b, SAMPLE_BUCKETS + 1) {
+		count[b] += my_count[b];
+		mass[b] += my_mass[b];
+	  }
+	}
+  }
+
+  // Find the bucket where the cut falls; the ones before it are kept whole.
+  // With neither cut it is past the last bucket, and nothing needs sorting.
+  double total = 0, kept = 0;
+  LOOP(b, SAMPLE_BUCKETS + 1) total += mass[b];
+  int cut = 0, above = 0;
+  for (; cut <= SAMPLE_BUCKETS; cut++) {
+	if (s->top_k ? above + count[cut] >= s->top_k : s->top_p < 1 && kept + mass[cut] >= s->top_p * total) break;
+	above += count[cut];
+	kept += mass[cut];
+  }
+
+  // Sort that bucket and keep its best until the cut is reached
+  int num = cut <= SAMPLE_BUCKETS ? count[cut] : 0, taken = 0;
+  candidate_t* c = malloc((num + 1) * sizeof(candidate_t));
+  float* w = malloc((num + 1) * sizeof(float));
+  num = sample_bucket_ids(x, n, max, scale, cut, cut, c, num);
+  qsort(c, num, sizeof(candidate_t), candidate_cmp);
+  LOOP(j, num) w[j] = c[j].logit - max;
+  exp_array(w, num, 1 / t);
+  double part = 0;
+  while (taken < num && !(s->top_k ? above + taken >= s->top_k : kept + part >= s->top_p * total)) {
+	part += w[taken++];
+  }
+
+  int id = -1;
+  if (s->top_k && s->top_p < 1) {
+	// A top k over TOPK_MAX still needs its own top p cut, best first
+	int m = above + taken;
+	candidate_t* all = malloc(m * sizeof(candidate_t));
+	float* aw = malloc(m * sizeof(float));
+	int got = cut ? sample_bucket_ids(x, n, max, scale, 0, cut - 1, all, above) : 0;
+	memcpy(all + got, c, taken * sizeof(candidate_t));
+	m = got + taken;
+	qsort(all, m, sizeof(candidate_t), candidate_cmp);
+	LOOP(j, m) aw[j] = all[j].logit - max;
+	exp_array(aw, m, 1 / t);
+	double sum = 0, nucleus = 0;
+	LOOP(j, m) sum += aw[j];
+	int keep = m;
+	LOOP(j, m) {
+	  if ((nucleus += aw[j]) >= s->top_p * sum) {
+		keep = j + 1;
+		break;
+	  }
+	}
+	id = all[sample_index(aw, keep, nucleus < sum ? nucleus : sum, sample_uniform(s))].id;
+	free(all);
+	free(aw);
+  } else {
+	// Draw a bucket by its weight, then a logit within it
+	double u = sample_uniform(s) * (kept + part);
+	LOOP(b, cut) {
+	  if (u < mass[b] && count[b]) {
+		candidate_t* in = malloc(count[b] * sizeof(candidate_t));
+		float* iw = malloc(count[b] * sizeof(float));
+		int m = sample_bucket_ids(x, n, max, scale, b, b, in, count[b]);
+		LOOP(j, m) iw[j] = in[j].logit - max;
+		exp_array(iw, m, 1 / t);
+		double sum = 0;
+		LOOP(j, m) sum += iw[j];
+		if (m) id = in[sample_index(iw, m, sum, u / mass[b])].id;
+		free(in);
+		free(iw);
+		break;
+	  }
+	  u -= mass[b];
+	}
+	if (id < 0 && taken) id = c[sample_index(w, taken, part, u < part ? u / part : 0)].id;
+  }
+  free(c);
+  free(w);
+  return id < 0 ? top.id[0] : id;
+}
+
+// Approximate greedy logits. Greedy decoding only needs the row of wte
+// with the largest product with the last hidden state, so with
+// GPT2_MIPS=P the rows are clustered once at load time (k-means on a
+// sample, then every row goes to its nearest centroid) and each token
+// only scores the centroids and then, exactly, the rows of at most P
+// clusters. A cluster holds no row scoring more than
+//   q . centroid + |q| * radius
+// (radius: its furthest row from the centroid), so the clusters are taken
+// best bound first, and the search stops early once the best row found
+// beats every bound left, in which case the answer is exactly the full
+// argmax. Every GPT2_MIPS_CHECK-th token (default 16, 0 for never) the
+// full logits are computed as well, to measure how often the two agree.
+#define MIPS_CLUSTERS 256
+#define MIPS_ITERATIONS 8
+#define MIPS_SAMPLE 8    // k-means runs on every 8th row, until the last round
+
+typedef struct {
+  int probes, check_every;
+  float* centroids;  // [MIPS_CLUSTERS][DIM]
+  float radius[MIPS_CLUSTERS];
+  int start[MIPS_CLUSTERS + 1];  // the rows of cluster c are ids[start[c]..start[c+1])
+  int* ids;
+  long tokens, proven, checked, matched;
+} mips_t;
+
+mips_t g_mips;
+
+static inline float dot_n(const float* a, const float* b, int n) {
+  vfloat acc = v_set(0);
+  int i = 0;
+  for (; i + VW <= n; i += VW) acc = v_fma(v_load(a + i), v_load(b + i), acc);
+  float t[VW], s = 0;
+  v_store(t, acc);
+  LOOP(j, VW) s += t[j];
+  for (; i < n; i++) s += a[i] * b[i];
+  return s;
+}
+
+void mips_init(Matrix wte) {
+  char *probes = getenv("GPT2_MIPS"), *check = getenv("GPT2_MIPS_CHECK");
+  if (!probes || atoi(probes) <= 0) return;
+  double start = now_seconds();
+  int V = wte.rows, K = MIPS_CLUSTERS;
+  float *c = malloc((size_t)K * DIM * sizeof(float)), *sums = malloc((size_t)K * DIM * sizeof(float));
+  float half_norm[MIPS_CLUSTERS];
+  int* assign = malloc(V * sizeof(int));
+  int counts[MIPS_CLUSTERS];
+  LOOP(k, K) memcpy(c + k*DIM, wte.dat + (size_t)(k * (V / K)) * DIM, DIM * sizeof(float));
+
+  LOOP(it, MIPS_ITERATIONS) {
+	// Nearest centroid: the largest x . c - |c|^2 / 2
+	int step = it < MIPS_ITERATIONS - 1 ? MIPS_SAMPLE : 1;
+	LOOP(k, K) half_norm[k] = dot_n(c + k*DIM, c + k*DIM, DIM) / 2;
+	#ifdef GOFAST
+	#pragma omp parallel for
+	#endif
+	for (int v = 0; v < V; v += step) {
+	  const float* x = wte.dat + (size_t)v * DIM;
+	  float best = -INFINITY;
+	  LOOP(k, K) {
+		float d = dot_n(x, c + k*DIM, DIM) - half_norm[k];
+		if (d > best) {
+		  best = d;
+		  assign[v] = k;
+		}
+	  }
+	}
+	if (step == 1) break;
+	// Move each centroid to the mean of its rows (an empty one stays put)
+	memset(sums, 0, (size_t)K * DIM * sizeof(float));
+	memset(counts, 0, sizeof(counts));
+	for (int v = 0; v < V; v += step) {
+	  counts[assign[v]]++;
+	  LOOP(j, DIM) sums[assign[v]*DIM + j] += wte.dat[(size_t)v * DIM + j];
+	}
+	LOOP(k, K) {
+	  if (counts[k]) LOOP(j, DIM) c[k*DIM + j] = sums[k*DIM + j] / counts[k];
+	}
+  }
+
+  // Group the rows by cluster and find each cluster's radius
+  memset(counts, 0, sizeof(counts));
+  LOOP(v, V) counts[assign[v]]++;
+  g_mips.start[0] = 0;
+  LOOP(k, K) g_mips.start[k + 1] = g_mips.start[k] + counts[k];
+  g_mips.ids = malloc(V * sizeof(int));
+  memset(counts, 0, sizeof(counts));
+  LOOP(v, V) g_mips.ids[g_mips.start[assign[v]] + counts[assign[v]]++] = v;
+  #ifdef GOFAST
+  #pragma omp parallel for
+  #endif
+  LOOP(k, K) {
+	float r = 0;
+	for (int i = g_mips.start[k]; i < g_mips.start[k + 1]; i++) {
+	  const float* x = wte.dat + (size_t)g_mips.ids[i] * DIM;
+	  float d = 0;
+	  LOOP(j, DIM) d += (x[j] - c[k*DIM + j]) * (x[j] - c[k*DIM + j]);
+	  if (d > r) r = d;
+	}
+	g_mips.radius[k] = sqrtf(r);
+  }
+  free(sums);
+  free(assign);
+  g_mips.centroids = c;
+  g_mips.probes = atoi(probes) < K ? atoi(probes) : K;
+  g_mips.check_every = check ? atoi(check) : 16;
+  fprintf(stderr, "GPT2_MIPS: %d clusters of %d rows on average in %.1f s, scoring at most %d per token\n",
+		  K, V / K, now_seconds() - start, g_mips.probes);
+}
+
+int mips_bound_cmp(const void* a, const void* b) {
+  float x = ((const float*)a)[0], y = ((const float*)b)[0];
+  return (x < y) - (x > y);
+}
+
+// The (probably) largest logit's id for the last hidden state q
+int mips_argmax(Matrix q, Matrix wte) {
+  float qn = sqrtf(dot_n(q.dat, q.dat, DIM));
+  float order[MIPS_CLUSTERS][2];  // bound, cluster
+  LOOP(k, MIPS_CLUSTERS) {
+	order[k][0] = dot_n(q.dat, g_mips.centroids + k*DIM, DIM) + qn * g_mips.radius[k];
+	order[k][1] = k;
+  }
+  qsort(order, MIPS_CLUSTERS, sizeof(order[0]), mips_bound_cmp);
+
+  float best = -INFINITY;
+  int id = 0, p = 0;
+  for (; p < g_mips.probes && order[p][0] > best; p++) {
+	int k = order[p][1];
+	for (int i = g_mips.start[k]; i < g_mips.start[k + 1]; i++) {
+	  int v = g_mips.ids[i];
+	  float s = dot_n(q.dat, wte.dat + (size_t)v * DIM, DIM);
+	  if (s > best || (s == best && v < id)) {
+		best = s;
+		id = v;
+	  }
+	}
+  }
+  g_mips.proven += p == MIPS_CLUSTERS || order[p][0] <= best;
+
+  if (g_mips.check_every && g_mips.tokens % g_mips.check_every == 0) {
+	topk_t full;
+	topk(matmul_t_fast(q, wte).dat, wte.rows, 1, &full);
+	g_mips.checked++;
+	g_mips.matched += full.id[0] == id;
+  }
+  if (++g_mips.tokens % 100 == 0) {
+	fprintf(stderr, "GPT2_MIPS: %ld tokens, %.1f%% proven exact by the bounds", g_mips.tokens,
+			100. * g_mips.proven / g_mips.tokens);
+	if (g_mips.checked) {
+	  fprintf(stderr, ", %ld of %ld checked (%.1f%%) matched the full logits", g_mips.matched, g_mips.checked,
+			  100. * g_mips.matched / g_mips.checked);
+	}
+	fprintf(stderr, "\n");
+  }
+  return id;
+}
+
+// Device-resident forward pass.
+// matmul_t_fast round-trips every single product through the host, and for
+// small decode shapes the launch and sync overhead costs more than the kernel.
+// With GPT2_CL_PIPELINE set we instead upload the weights once, keep every
+// activation in a device buffer, and enqueue the whole layer graph without
+// ever waiting on it: each command waits on the event of the one before, so
+// the same graph is also correct on an out-of-order queue
+// (GPT2_CL_PIPELINE=ooo). The host only blocks on reading back the logits.
+//
+// GPT2_CL_DEVICES runs the same graph tensor-parallel over several devices:
+// "gpu" opens every GPU, "all" every OpenCL device, and "sub:N" splits the
+// first device into N sub-devices. Each device is a shard that holds a slice
+// of every layer: its attention heads (their columns of c_attn and input
+// columns of the attention c_proj), its part of the MLP hidden units (columns
+// of c_fc, input columns of the MLP c_proj) and its part of the vocabulary.
+// LayerNorm and the residual stream are replicated, and the partial outputs
+// of the two projections are summed on the host after each half-layer.
+
+// Record the outcome of an enqueue that produced ev; on success ev becomes
+// the new tail of the shard's dependency chain. The first error sticks and
+// turns every later enqueue of the pass into a no-op.
+void cl_pipeline_advance(cl_pipeline_t* p, cl_int err, cl_event ev) {
+  if (err != CL_SUCCESS) {
+    p->err = err;
+    return;
+  }
+  if (p->tail) clReleaseEvent(p->tail);
+  p->tail = ev;
+}
+
+// Enqueue a kernel behind everything enqueued so far on this shard.
+void cl_pipeline_run(cl_pipeline_t* p, cl_kernel kernel, cl_uint dims, const size_t* global, const size_t* local) {
+  cl_event ev;
+  if (p->err != CL_SUCCESS) return;
+  cl_pipeline_advance(p, clEnqueueNDRangeKernel(p->queue, kernel, dims, NULL, global, local,
+                                                p->tail ? 1 : 0, p->tail ? &p->tail : NULL, &ev), ev);
+  if (p->err == CL_SUCCESS) trace_cl(1 + p - g_cl_shards, ev, kernel, NULL);
+}
+
+// Non-blocking copies between a shard and the host, chained like kernels.
+void cl_pipeline_write(cl_pipeline_t* p, cl_mem buf, size_t offset, size_t bytes, const void* src) {
+  cl_event ev;
+  if (p->err != CL_SUCCESS) return;
+  cl_pipeline_advance(p, clEnqueueWriteBuffer(p->queue, buf, CL_FALSE, offset, bytes, src,
+                                              p->tail ? 1 : 0, p->tail ? &p->tail : NULL, &ev), ev);
+  if (p->err == CL_SUCCESS) trace_cl(1 + p - g_cl_shards, ev, NULL, "write");
+}
+
+void cl_pipeline_read(cl_pipeline_t* p, cl_mem buf, size_t offset, size_t bytes, void* dst) {
+  cl_event ev;
+  if (p->err != CL_SUCCESS) return;
+  cl_pipeline_advance(p, clEnqueueReadBuffer(p->queue, buf, CL_FALSE, offset, bytes, dst,
+                                             p->tail ? 1 : 0, p->tail ? &p->tail : NULL, &ev), ev);
+  if (p->err == CL_SUCCESS) trace_cl(1 + p - g_cl_shards, ev, NULL, "read");
+}
+
+// A read-only copy of host, or an uninitialized activation buffer when host
+// is NULL (kept in host-visible memory on zero copy devices, so reading it
+// back is a plain memcpy).
+cl_mem cl_pipeline_buffer(cl_pipeline_t* p, size_t floats, float* host) {
+  cl_int err;
+  cl_mem buf = clCreateBuffer(p->context, host ? CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR :
+                              CL_MEM_READ_WRITE | (p->host_align ? CL_MEM_ALLOC_HOST_PTR : 0),
+                              floats * sizeof(float), host, &err);
+  return err == CL_SUCCESS ? buf : NULL;
+}
+
+// A read-only view of a weight matrix, which stays in the arena for good:
+// on zero copy devices the weights are not duplicated.
+cl_mem cl_pipeline_weight(cl_pipeline_t* p, size_t floats, float* host) {
+  cl_int err;
+  cl_mem buf = cl_host_buffer(p->context, p->host_align, CL_MEM_READ_ONLY, host, floats * sizeof(float), &err);
+  return err == CL_SUCCESS ? buf : NULL;
+}
+
+// Upload columns c0..c0+n of each of the `parts` equal column blocks of w
+// (cl_shard_rows: rows r0..r0+n of each row block). A slice that covers all
+// of w is uploaded in place.
+cl_mem cl_shard_cols(cl_pipeline_t* p, Matrix w, int parts, int c0, int n) {
+  if (parts * n == w.cols) return cl_pipeline_weight(p, (size_t)w.rows * w.cols, w.dat);
+  float* host = malloc((size_t)w.rows * parts * n * sizeof(float));
+  if (!host) return NULL;
+  int block = w.cols / parts;
+  LOOP(i, w.rows) {
+    LOOP(part, parts) {
+      memcpy(host + ((size_t)i*parts + part) * n, w.dat + (size_t)i*w.cols + part*block + c0, n * sizeof(float));
+    }
+  }
+  cl_mem buf = cl_pipeline_buffer(p, (size_t)w.rows * parts * n, host);
+  free(host);
+  return buf;
+}
 
-// Transpose a matrix flipping the rows and columns
-Matrix transpose(Matrix a) {
-  Matrix out = NewMatrix(a.cols, a.rows, 1);
-  LOOP(i, a.rows*a.cols) {
-	out.dat[i%a.cols*a.rows+i/a.cols] = a.dat[i];
+cl_mem cl_shard_rows(cl_pipeline_t* p, Matrix w, int parts, int r0, int n) {
+  if (parts * n == w.rows) return cl_pipeline_weight(p, (size_t)w.rows * w.cols, w.dat);
+  float* host = malloc((size_t)parts * n * w.cols * sizeof(float));
+  if (!host) return NULL;
+  int block = w.rows / parts;
+  LOOP(part, parts) {
+    memcpy(host + (size_t)part * n * w.cols, w.dat + (size_t)(part*block + r0) * w.cols, (size_t)n * w.cols * sizeof(float));
   }
-  return out;
+  cl_mem buf = cl_pipeline_buffer(p, (size_t)parts * n * w.cols, host);
+  free(host);
+  return buf;
 }
 
-// Efficient incremental matrix multiplication.
-// We make the following optimizations:
-// 1. Instead of multiplying A by B, we do A by transpose(B)
-//    This keeps the reads out of the B matrix in sequential order
-//    which helps cache efficiency
-// 2. Instaed of performing the product all at once, we block it
-//    into 4x4 inner computations which again is much more cache efficient
-// 3. If the fast flag is defined, we use OMP to parallelize across threads
-// 4. We re-use computation from prior runs, and only fill in the
-//    *new* rows that weren't populated the prior run through the model
-Matrix matmul_t_fast(Matrix a, Matrix b) {
-  Matrix out = NewMatrix(a.rows, b.rows, 1);
-  if (!g_cl_kernel_matmul_a_bt) {
-    #ifdef GOFAST
-    #pragma omp parallel
-    #endif
-    {
-    #ifdef GOFAST
-    #pragma omp for
-    #endif
-    for (int i = 0; i < a.rows; i++) {
-      for (int j = 0; j < b.rows; j++) {
-        float s = 0;
-        for (int k = 0; k < a.cols; k++) {
-          s += a.dat[i * a.cols + k] * b.dat[j * b.cols + k];
-        }
-        out.dat[i * b.rows + j] = s;
-      }
-    }
-    }
-    return out;
+// This shard's part of weights[i]. Per layer (in on-disk order) these are
+//   0 c_attn.b  1 c_attn.w   -> the shard's heads out of each of Q, K, V
+//   2 c_proj.b  3 c_proj.w   -> the shard's heads as input columns; the bias
+//                               goes to shard 0 only, the rest add zeros
+//   4-7 ln_1, ln_2           -> replicated
+//   8 c_fc.b    9 c_fc.w     -> the shard's hidden units
+//   10 c_proj.b 11 c_proj.w  -> the shard's hidden units as input columns
+// and the final ln_f is replicated.
+cl_mem cl_shard_weight(cl_pipeline_t* p, Matrix w, int i, int first) {
+  int j = i < 12*NLAYER ? i % 12 : -1;
+  int h0 = 64*p->head0, h = 64*p->heads;
+  if (j == 0) return cl_shard_cols(p, w, 3, h0, h);
+  if (j == 1) return cl_shard_rows(p, w, 3, h0, h);
+  if (j == 3) return cl_shard_cols(p, w, 1, h0, h);
+  if (j == 8) return cl_shard_cols(p, w, 1, p->hidden0, p->hiddens);
+  if (j == 9) return cl_shard_rows(p, w, 1, p->hidden0, p->hiddens);
+  if (j == 11) return cl_shard_cols(p, w, 1, p->hidden0, p->hiddens);
+  if ((j == 2 || j == 10) && !first) {
+    float* zeros = calloc(w.cols, sizeof(float));
+    if (!zeros) return NULL;
+    cl_mem buf = cl_pipeline_buffer(p, w.cols, zeros);
+    free(zeros);
+    return buf;
   }
+  return cl_pipeline_weight(p, (size_t)w.rows * w.cols, w.dat);
+}
 
+// Create the kernels, upload this shard's weights and allocate activations
+// for up to 1024 tokens. Returns 0 on success.
+int cl_shard_init(cl_pipeline_t* p, int first, Matrix* weights, int num_weights, Matrix wpe, Matrix wte) {
   cl_int err;
-  size_t bytes_a = (size_t)a.rows * (size_t)a.cols * sizeof(float);
-  size_t bytes_b = (size_t)b.rows * (size_t)b.cols * sizeof(float);
-  size_t bytes_c = (size_t)out.rows * (size_t)out.cols * sizeof(float);
+  const char* names[] = {"embed_tokens", "layernorm_rows", "fused_elementwise", "attention_causal", "topk"};
+  cl_kernel* kernels[] = {&p->embed, &p->layernorm, &p->fused, &p->attention, &p->topk};
+  LOOP(i, 5) {
+    *kernels[i] = clCreateKernel(p->program, names[i], &err);
+    if (err != CL_SUCCESS) return -1;
+  }
+  if (p->program != g_cl_program && cl_matmul_init(&p->matmul, p->program, p->device)) return -1;
 
-  cl_mem buf_a = clCreateBuffer(g_cl_context, CL_MEM_READ_ONLY, bytes_a, NULL, &err);
-  if (err != CL_SUCCESS) return out;
-  cl_mem buf_b = clCreateBuffer(g_cl_context, CL_MEM_READ_ONLY, bytes_b, NULL, &err);
-  if (err != CL_SUCCESS) {
-    clReleaseMemObject(buf_a);
-    return out;
+  p->weights = calloc(num_weights, sizeof(cl_mem));
+  if (!p->weights) return -1;
+  p->num_weights = num_weights;
+  LOOP(i, num_weights) {
+    if (!(p->weights[i] = cl_shard_weight(p, weights[i], i, first))) return -1;
   }
-  cl_mem buf_c = clCreateBuffer(g_cl_context, CL_MEM_WRITE_ONLY, bytes_c, NULL, &err);
-  if (err != CL_SUCCESS) {
-    clReleaseMemObject(buf_a);
-    clReleaseMemObject(buf_b);
-    return out;
+  // The embedding is looked up on the device only when it holds all of wte
+  // wpe is a DIM x 1024 view of the 1024 x DIM position table
+  if (p->vocab == wte.rows && !(p->wpe = cl_pipeline_weight(p, (size_t)wpe.rows * wpe.cols, dense(transpose(wpe)).dat))) return -1;
+  if (!(p->wte = cl_pipeline_weight(p, (size_t)p->vocab * DIM, wte.dat + (size_t)p->vocab0 * DIM))) return -1;
+
+  size_t rows = 1024;
+  p->tokens = clCreateBuffer(p->context, CL_MEM_READ_ONLY, rows * sizeof(int), NULL, &err);
+  if (err != CL_SUCCESS) return -1;
+  cl_mem* acts[] = {&p->line, &p->ln, &p->qkv, &p->attn, &p->hidden, &p->proj, &p->last, &p->logits,
+                    p->top_vals, p->top_ids, p->top_vals + 1, p->top_ids + 1};
+  size_t sizes[] = {rows*DIM, rows*DIM, rows*64*p->heads*3, rows*64*p->heads, rows*p->hiddens, rows*DIM, DIM, p->vocab,
+                    TOPK_GROUPS*TOPK_MAX, TOPK_GROUPS*TOPK_MAX, TOPK_MAX, TOPK_MAX};
+  LOOP(i, 12) {
+    if (!(*acts[i] = cl_pipeline_buffer(p, sizes[i], NULL))) return -1;
   }
+  p->host = malloc(rows * DIM * sizeof(float));
+  return p->host ? 0 : -1;
+}
 
-  clEnqueueWriteBuffer(g_cl_queue, buf_a, CL_TRUE, 0, bytes_a, a.dat, 0, NULL, NULL);
-  clEnqueueWriteBuffer(g_cl_queue, buf_b, CL_TRUE, 0, bytes_b, b.dat, 0, NULL, NULL);
+// Set up the shards. Leaves g_cl_pipeline_ready unset (and matmul_t_fast in
+// charge) on any failure.
+void cl_pipeline_init(Matrix* weights, int num_weights, Matrix wpe, Matrix wte) {
+  char* mode = getenv("GPT2_CL_PIPELINE");
+  char* devices = getenv("GPT2_CL_DEVICES");
+  if (!mode && !devices) return;
+  int out_of_order = mode && !strcmp(mode, "ooo");
 
-  cl_uint M = (cl_uint)a.rows;
-  cl_uint N = (cl_uint)b.rows;
-  cl_uint K = (cl_uint)a.cols;
+  cl_int err;
+  gpu_device_info_t infos[MAX_SHARDS];
+  int count = 1;
+  if (!devices) {
+    // Single device: reuse the context and program init_opencl made
+    if (!g_cl_matmul.kernels[0]) return;
+    cl_pipeline_t* p = g_cl_shards;
+    p->matmul = g_cl_matmul;
+    p->context = g_cl_context;
+    p->device = g_cl_device;
+    p->program = g_cl_program;
+    p->queue = g_cl_queue;
+    p->host_align = g_cl_host_align;
+    if (out_of_order) {
+      cl_command_queue queue = create_command_queue_simple(g_cl_context, g_cl_device, getenv("GPT2_TRACE") != NULL, CL_TRUE, &err);
+      if (queue) p->queue = queue;
+    }
+  } else {
+    if (!strncmp(devices, "sub:", 4)) {
+      gpu_device_info_t root;
+      int subs = atoi(devices + 4);
+      subs = subs < MAX_SHARDS ? subs : MAX_SHARDS;
+      count = subs > 0 && select_all_devices(CL_DEVICE_TYPE_ALL, &root, 1) ? create_sub_devices(&root, subs, infos) : 0;
+    } else {
+      count = select_all_devices(strcmp(devices, "all") ? CL_DEVICE_TYPE_GPU : CL_DEVICE_TYPE_ALL, infos, MAX_SHARDS);
+    }
+    // Every shard needs at least one head
+    if (count > NHEAD) count = NHEAD;
+    if (count == 0) return;
+
+    LOOP(d, count) {
+      cl_pipeline_t* p = g_cl_shards + d;
+      g_cl_num_shards = d + 1;
+      p->device = infos[d].device;
+      p->host_align = cl_host_align(infos + d);
+      p->context = create_gpu_context(&infos[d], &err);
+      if (err != CL_SUCCESS) return;
+      cl_bool profiling = getenv("GPT2_TRACE") != NULL;
+      p->queue = out_of_order ? create_command_queue_simple(p->context, p->device, profiling, CL_TRUE, &err)
+                              : create_gpu_queue(p->context, &infos[d], profiling, &err);
+      if (err != CL_SUCCESS) return;
+      if (!(p->program = build_program(p->context, p->device, NULL))) return;
+    }
+  }
 
-  clSetKernelArg(g_cl_kernel_matmul_a_bt, 0, sizeof(cl_mem), &buf_a);
-  clSetKernelArg(g_cl_kernel_matmul_a_bt, 1, sizeof(cl_mem), &buf_b);
-  clSetKernelArg(g_cl_kernel_matmul_a_bt, 2, sizeof(cl_mem), &buf_c);
-  clSetKernelArg(g_cl_kernel_matmul_a_bt, 3, sizeof(cl_uint), &M);
-  clSetKernelArg(g_cl_kernel_matmul_a_bt, 4, sizeof(cl_uint), &N);
-  clSetKernelArg(g_cl_kernel_matmul_a_bt, 5, sizeof(cl_uint), &K);
+  g_cl_num_shards = count;
+  LOOP(d, count) {
+    cl_pipeline_t* p = g_cl_shards + d;
+    p->head0 = d * NHEAD / count;
+    p->heads = (d+1) * NHEAD / count - p->head0;
+    p->hidden0 = d * 4*DIM / count;
+    p->hiddens = (d+1) * 4*DIM / count - p->hidden0;
+    p->vocab0 = d * wte.rows / count;
+    p->vocab = (d+1) * wte.rows / count - p->vocab0;
+    if (cl_shard_init(p, d == 0, weights, num_weights, wpe, wte)) return;
+    if (devices) {
+      fprintf(stderr, "GPT2_CL_DEVICES: shard %d on %s: %d heads, %d hidden, %d vocab\n",
+              d, infos[d].device_name, p->heads, p->hiddens, p->vocab);
+    }
+  }
+  if (!(g_cl_stage = malloc((size_t)1024 * DIM * sizeof(float)))) return;
 
-  size_t global_work_size[2] = {(size_t)M, (size_t)N};
-  size_t local_work_size[2] = {16, 16};
-  if (local_work_size[0] > global_work_size[0]) local_work_size[0] = 1;
-  if (local_work_size[1] > global_work_size[1]) local_work_size[1] = 1;
+  g_cl_pipeline_ready = 1;
+}
 
-  err = clEnqueueNDRangeKernel(g_cl_queue, g_cl_kernel_matmul_a_bt, 2, NULL, global_work_size, local_work_size, 0, NULL, NULL);
-  if (err == CL_SUCCESS) {
-    clFinish(g_cl_queue);
-    clEnqueueReadBuffer(g_cl_queue, buf_c, CL_TRUE, 0, bytes_c, out.dat, 0, NULL, NULL);
-  }
+// y = LayerNorm(x) over rows, using the bias/gain pair at w[0], w[1]
+void cl_pipeline_layernorm(cl_pipeline_t* p, cl_mem x, cl_mem y, cl_mem* w, cl_uint rows) {
+  cl_uint cols = DIM;
+  clSetKernelArg(p->layernorm, 0, sizeof(cl_mem), &x);
+  clSetKernelArg(p->layernorm, 1, sizeof(cl_mem), &y);
+  clSetKernelArg(p->layernorm, 2, sizeof(cl_mem), &w[0]);
+  clSetKernelArg(p->layernorm, 3, sizeof(cl_mem), &w[1]);
+  clSetKernelArg(p->layernorm, 4, sizeof(cl_uint), &rows);
+  clSetKernelArg(p->layernorm, 5, sizeof(cl_uint), &cols);
+  size_t global = rows;
+  cl_pipeline_run(p, p->layernorm, 1, &global, NULL);
+}
 
-  clReleaseMemObject(buf_a);
-  clReleaseMemObject(buf_b);
-  clReleaseMemObject(buf_c);
-  return out;
+// out = in * w[1]^T + w[0], the device version of Linear(); w[0] may be NULL.
+// With gelu set GELU follows, and a residual (which may be out itself) is
+// added last, both in the matmul kernel's epilogue.
+void cl_pipeline_linear(cl_pipeline_t* p, cl_mem in, cl_mem out, cl_mem* w, cl_uint M, cl_uint N, cl_uint K,
+                        cl_uint gelu, cl_mem residual) {
+  size_t global[2], local[2];
+  cl_epilogue_t e = {w[0], residual, gelu, 0};
+  cl_kernel kernel = cl_matmul_setup(&p->matmul, in, w[1], out, &e, M, N, K, global, local);
+  cl_pipeline_run(p, kernel, 2, global, local);
 }
 
-// Take a slice out of a larger matrix and return a new matrix with the given shape
-Matrix slice(Matrix a, int b, int rows, int cols) {
-  Matrix out = {a.dat + b*rows, rows, cols};
-  return out;
+// Apply e to the rows x cols matrix x in one pass
+void cl_pipeline_fused(cl_pipeline_t* p, cl_mem x, const cl_epilogue_t* e, cl_uint rows, cl_uint cols) {
+  cl_uint n = rows * cols;
+  clSetKernelArg(p->fused, 0, sizeof(cl_mem), &x);
+  clSetKernelArg(p->fused, 1, sizeof(cl_mem), &e->bias);
+  clSetKernelArg(p->fused, 2, sizeof(cl_mem), &e->residual);
+  clSetKernelArg(p->fused, 3, sizeof(cl_uint), &n);
+  clSetKernelArg(p->fused, 4, sizeof(cl_uint), &cols);
+  clSetKernelArg(p->fused, 5, sizeof(cl_uint), &e->gelu);
+  clSetKernelArg(p->fused, 6, sizeof(float), &e->scale);
+  size_t global = n;
+  cl_pipeline_run(p, p->fused, 1, &global, NULL);
 }
 
-// A somewhat weird unary operator that computes the "layernorm" operator.
-// Exactly what it does doesn't matter.
-Matrix LayerNorm(Matrix a, int i) {
-  Matrix b = add(a, divide_const(sum(a), -a.cols));
-  Matrix k = divide_const(sum(multiply(add(NewMatrix(b.rows,b.cols,1),b), b)), b.cols-1); // todo can remove -1
-  Matrix out = add_tile(multiply_tile(multiply(add(NewMatrix(b.rows,b.cols,1),b), mat_isqrt(add_const(k, 1e-5),0)), layer_weights[i+1]), layer_weights[i]);
+// line += proj on every shard, once allreduce has summed their partial
+// projections. A single shard instead adds the residual in the projection.
+void cl_pipeline_residual(int rows) {
+  if (g_cl_num_shards == 1) return;
+  LOOP(d, g_cl_num_shards) {
+    cl_pipeline_t* p = g_cl_shards + d;
+    cl_epilogue_t e = {NULL, p->proj, 0, 0};
+    cl_pipeline_fused(p, p->line, &e, rows, DIM);
+  }
+}
 
-  return out;
+// Sum the partial rows x DIM products left in every shard's proj buffer and
+// hand the total back to all of them. A no-op with a single shard.
+void cl_pipeline_allreduce(int rows) {
+  size_t floats = (size_t)rows * DIM;
+  if (g_cl_num_shards == 1) return;
+
+  LOOP(d, g_cl_num_shards) {
+    cl_pipeline_read(g_cl_shards + d, g_cl_shards[d].proj, 0, floats * sizeof(float), g_cl_shards[d].host);
+  }
+  // Once every read is done, so are all earlier writes out of g_cl_stage
+  LOOP(d, g_cl_num_shards) {
+    cl_pipeline_t* p = g_cl_shards + d;
+    if (p->err == CL_SUCCESS) p->err = clWaitForEvents(1, &p->tail);
+    if (p->err != CL_SUCCESS) return;
+  }
+  memset(g_cl_stage, 0, floats * sizeof(float));
+  LOOP(d, g_cl_num_shards) {
+    for (size_t i = 0; i < floats; i++) g_cl_stage[i] += g_cl_shards[d].host[i];
+  }
+  LOOP(d, g_cl_num_shards) {
+    cl_pipeline_write(g_cl_shards + d, g_cl_shards[d].proj, 0, floats * sizeof(float), g_cl_stage);
+  }
 }
 
-// Compute a linear matrix layer, x * W + b
-#define Linear(a, i) add_tile(matmul_t_fast(a, layer_weights[i+1]), layer_weights[i])
+// The top k of this shard's logits, in two stages of the topk kernel:
+// TOPK_GROUPS work-groups each find the best k of their share, then one
+// work-group merges those. Only the k (id, logit) pairs are read back.
+void cl_pipeline_topk(cl_pipeline_t* p, cl_uint k, topk_t* out) {
+  cl_mem none = NULL;
+  LOOP(stage, 2) {
+	cl_uint n = stage ? TOPK_GROUPS * k : p->vocab;
+	clSetKernelArg(p->topk, 0, sizeof(cl_mem), stage ? p->top_vals : &p->logits);
+	clSetKernelArg(p->topk, 1, sizeof(cl_mem), stage ? p->top_ids : &none);
+	clSetKernelArg(p->topk, 2, sizeof(cl_uint), &n);
+	clSetKernelArg(p->topk, 3, sizeof(cl_uint), &k);
+	clSetKernelArg(p->topk, 4, sizeof(cl_mem), p->top_vals + stage);
+	clSetKernelArg(p->topk, 5, sizeof(cl_mem), p->top_ids + stage);
+	clSetKernelArg(p->topk, 6, TOPK_GROUP * TOPK_MAX * sizeof(float), NULL);
+	clSetKernelArg(p->topk, 7, TOPK_GROUP * TOPK_MAX * sizeof(int), NULL);
+	size_t global = stage ? TOPK_GROUP : TOPK_GROUP * TOPK_GROUPS, local = TOPK_GROUP;
+	cl_pipeline_run(p, p->topk, 1, &global, &local);
+  }
+  out->k = k;
+  cl_pipeline_read(p, p->top_vals[1], 0, k * sizeof(float), out->logit);
+  cl_pipeline_read(p, p->top_ids[1], 0, k * sizeof(int), out->id);
+}
 
-// Read a weight matrix out of the data file into memory
-Matrix read_matrix(int rows, int cols) {
-  rows+=!rows; // if rows == 0 then load at least one row
-  cols+=!cols; // if cols == 0 then load at least one col
+// Enqueue the full network for n tokens and read back the top k (at most
+// TOPK_MAX) of the last one's logits, or with k = 0 all of them into logits.
+// On failure the caller falls back to the host path; the pipeline is disabled.
+cl_int cl_pipeline_forward(int* tokens, int n, Matrix wpe, Matrix wte, int k, topk_t* top, float* logits) {
+  cl_event ev;
+  cl_uint rows = n, dim = DIM;
+  int S = g_cl_num_shards;
+  topk_t shard_top[MAX_SHARDS];
+
+  LOOP(d, S) {
+    cl_pipeline_t* p = g_cl_shards + d;
+    p->err = CL_SUCCESS;
+    if (p->wpe) {
+      cl_pipeline_write(p, p->tokens, 0, n * sizeof(int), tokens);
+      clSetKernelArg(p->embed, 0, sizeof(cl_mem), &p->wte);
+      clSetKernelArg(p->embed, 1, sizeof(cl_mem), &p->wpe);
+      clSetKernelArg(p->embed, 2, sizeof(cl_mem), &p->tokens);
+      clSetKernelArg(p->embed, 3, sizeof(cl_mem), &p->line);
+      clSetKernelArg(p->embed, 4, sizeof(cl_uint), &rows);
+      clSetKernelArg(p->embed, 5, sizeof(cl_uint), &dim);
+      size_t embed_size[2] = {rows, dim};
+      cl_pipeline_run(p, p->embed, 2, embed_size, NULL);
+    } else {
+      // Sharded vocabulary: embed on the host once and send it to everyone
+      if (d == 0) {
+        LOOP(i, n) {
+          LOOP(j, DIM) {
+            g_cl_stage[i*DIM+j] = AT(wte, tokens[i], j) + AT(wpe, j, i);
+          }
+        }
+      }
+      cl_pipeline_write(p, p->line, 0, (size_t)n * DIM * sizeof(float), g_cl_stage);
+    }
+  }
+
+  LOOP(i, NLAYER) {
+    int layer = 12*layer_index(i);
+
+    LOOP(d, S) {
+      cl_pipeline_t* p = g_cl_shards + d;
+      cl_mem* w = p->weights + layer;
+      cl_uint heads = 64*p->heads;
+      cl_pipeline_layernorm(p, p->line, p->ln, w+4, rows);
+      cl_pipeline_linear(p, p->ln, p->qkv, w+0, rows, 3*heads, DIM, 0, NULL);
+
+      clSetKernelArg(p->attention, 0, sizeof(cl_mem), &p->qkv);
+      clSetKernelArg(p->attention, 1, sizeof(cl_mem), &p->attn);
+      clSetKernelArg(p->attention, 2, sizeof(cl_uint), &rows);
+      clSetKernelArg(p->attention, 3, sizeof(cl_uint), &heads);
+      size_t attn_size[2] = {rows, p->heads};
+      cl_pipeline_run(p, p->attention, 2, attn_size, NULL);
+
+      // One shard owns the whole projection and adds it to line straight away
+      cl_pipeline_linear(p, p->attn, S == 1 ? p->line : p->proj, w+2, rows, DIM, heads, 0, S == 1 ? p->line : NULL);
+    }
+    cl_pipeline_allreduce(n);
+    cl_pipeline_residual(n);
+
+    LOOP(d, S) {
+      cl_pipeline_t* p = g_cl_shards + d;
+      cl_mem* w = p->weights + layer;
+      cl_pipeline_layernorm(p, p->line, p->ln, w+6, rows);
+      cl_pipeline_linear(p, p->ln, p->hidden, w+8, rows, p->hiddens, DIM, 1, NULL);
+      cl_pipeline_linear(p, p->hidden, S == 1 ? p->line : p->proj, w+10, rows, DIM, p->hiddens, 0, S == 1 ? p->line : NULL);
+    }
+    cl_pipeline_allreduce(n);
+    cl_pipeline_residual(n);
+  }
 
-  Matrix a = NewMatrix(rows, cols, 1);
+  LOOP(d, S) {
+    cl_pipeline_t* p = g_cl_shards + d;
+    // Only the last row is needed for the logits
+    if (p->err == CL_SUCCESS) {
+      cl_pipeline_advance(p, clEnqueueCopyBuffer(p->queue, p->line, p->last, (size_t)(n-1) * DIM * sizeof(float), 0,
+                                                 DIM * sizeof(float), 1, &p->tail, &ev), ev);
+    }
+    cl_pipeline_layernorm(p, p->last, p->ln, p->weights + 12*NLAYER, 1);
+
+    cl_mem unembed[2] = {NULL, p->wte};
+    cl_pipeline_linear(p, p->ln, p->logits, unembed, 1, p->vocab, DIM, 0, NULL);
+    if (k) {
+      cl_pipeline_topk(p, k, shard_top + d);
+    } else {
+      cl_pipeline_read(p, p->logits, 0, p->vocab * sizeof(float), logits + p->vocab0);
+    }
+  }
 
-  // It's already stored as a float on disk. Just load the bytes.
-  // (This assumes your machine is little endian)
-  fread(a.dat, tmp, 1, fp); 
+  cl_int err = CL_SUCCESS;
+  LOOP(d, S) {
+    cl_pipeline_t* p = g_cl_shards + d;
+    clFinish(p->queue);
+    if (p->tail) clReleaseEvent(p->tail);
+    p->tail = NULL;
+    if (p->err != CL_SUCCESS) err = p->err;
+  }
+  if (err != CL_SUCCESS) {
+    fprintf(stderr, "GPT2_CL_PIPELINE: enqueue failed (err=%d), falling back to the host path\n", err);
+    g_cl_pipeline_ready = 0;
+    return err;
+  }
 
-  // Our matrix multiply assumes transposed weights.
-  return transpose(a);
+  // Each shard's ids count from the start of its slice of the vocabulary
+  if (!k) return err;
+  topk_init(top, k);
+  LOOP(d, S) {
+    LOOP(j, k) topk_insert(top, shard_top[d].logit[j], shard_top[d].id[j] + g_cl_shards[d].vocab0);
+  }
+  return err;
 }
 
-
 // And now for something completely different: byte pair encoding
 // This function takes a single word and produces the tokenization of that word
 // We do this with an exponential-time algorithm that's very short:
@@ -354,9 +3521,319 @@ int* tokenize(char* seq, /*INT*/int* result, /*INT*/int* result_end) {
   return result;
 }
 
+// Latency metrics. With GPT2_METRICS=file every reply records its time to
+// first token (from the end of the human's line), the time between its
+// tokens and how many tokens went in and came out, and every
+// GPT2_METRICS_INTERVAL seconds (default 10) the totals are written to
+// file in the Prometheus text format. The histograms are HDR style: 8
+// buckets per power of two microseconds, so a quantile is within 1/8 of
+// its value. Recording is a few relaxed atomic adds; the counters are in
+// shared memory, so the GPT2_SERVE workers all add to the same ones.
+#define HIST_SUB 8
+#define HIST_BUCKETS (30 * HIST_SUB)
+
+typedef struct {
+  _Atomic unsigned long count[HIST_BUCKETS];
+  _Atomic unsigned long total, sum_us;
+} histogram_t;
+
+typedef struct {
+  histogram_t ttft, itl;
+  _Atomic unsigned long requests, prefill_tokens, decode_tokens;
+} metrics_t;
+
+metrics_t* g_metrics;
+char* g_metrics_path;
+int g_metrics_interval = 10;
+
+int hist_bucket(unsigned long us) {
+  if (us < HIST_SUB) return us;
+  int e = 63 - __builtin_clzl(us);
+  int b = (e - 2) * HIST_SUB + (int)(us >> (e - 3)) - HIST_SUB;
+  return b < HIST_BUCKETS ? b : HIST_BUCKETS - 1;
+}
+
+// Smallest value in microseconds that lands in bucket b
+double hist_low(int b) {
+  if (b < HIST_SUB) return b;
+  return (double)(HIST_SUB + b % HIST_SUB) * (1ul << (b / HIST_SUB - 1));
+}
+
+void hist_add(histogram_t* h, double seconds) {
+  unsigned long us = seconds > 0 ? (unsigned long)(seconds * 1e6) : 0;
+  atomic_fetch_add_explicit(h->count + hist_bucket(us), 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&h->total, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&h->sum_us, us, memory_order_relaxed);
+}
+
+void metrics_count(_Atomic unsigned long* c, unsigned long n) {
+  atomic_fetch_add_explicit(c, n, memory_order_relaxed);
+}
+
+void hist_write(FILE* f, const char* name, const char* help, histogram_t* h) {
+  unsigned long count[HIST_BUCKETS], total = 0, below = 0;
+  LOOP(b, HIST_BUCKETS) total += count[b] = atomic_load_explicit(h->count + b, memory_order_relaxed);
+
+  fprintf(f, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+  LOOP(b, HIST_BUCKETS) {
+	below += count[b];
+	// One bound per power of two is plenty for Prometheus
+	if (b % HIST_SUB == HIST_SUB - 1 && b < HIST_BUCKETS - 1) {
+	  fprintf(f, "%s_bucket{le=\"%g\"} %lu\n", name, hist_low(b + 1) * 1e-6, below);
+	}
+  }
+  fprintf(f, "%s_bucket{le=\"+Inf\"} %lu\n", name, total);
+  fprintf(f, "%s_sum %g\n%s_count %lu\n", name, atomic_load(&h->sum_us) * 1e-6, name, total);
+
+  // The quantiles from the fine buckets, at the middle of their bucket
+  fprintf(f, "# HELP %s_quantile %s, quantiles\n# TYPE %s_quantile gauge\n", name, help, name);
+  double qs[] = {.5, .95, .99};
+  LOOP(i, 3) {
+	unsigned long want = (unsigned long)ceil(qs[i] * total), seen = 0;
+	int b = 0;
+	while (b < HIST_BUCKETS - 1 && (seen += count[b]) < want) b++;
+	double value = total ? (hist_low(b) + hist_low(b + 1)) * .5e-6 : 0;
+	fprintf(f, "%s_quantile{quantile=\"%g\"} %g\n", name, qs[i], value);
+  }
+}
+
+void metrics_write() {
+  char tmp[4096];
+  snprintf(tmp, sizeof(tmp), "%s.tmp", g_metrics_path);
+  FILE* f = fopen(tmp, "w");
+  if (!f) {
+	perror("GPT2_METRICS");
+	return;
+  }
+  fprintf(f, "# HELP gpt2_requests_total Replies finished.\n# TYPE gpt2_requests_total counter\n");
+  fprintf(f, "gpt2_requests_total %lu\n", atomic_load(&g_metrics->requests));
+  fprintf(f, "# HELP gpt2_prefill_tokens_total Tokens of input run through the model.\n# TYPE gpt2_prefill_tokens_total counter\n");
+  fprintf(f, "gpt2_prefill_tokens_total %lu\n", atomic_load(&g_metrics->prefill_tokens));
+  fprintf(f, "# HELP gpt2_decode_tokens_total Tokens generated.\n# TYPE gpt2_decode_tokens_total counter\n");
+  fprintf(f, "gpt2_decode_tokens_total %lu\n", atomic_load(&g_metrics->decode_tokens));
+  hist_write(f, "gpt2_time_to_first_token_seconds", "Time from a request to its first token", &g_metrics->ttft);
+  hist_write(f, "gpt2_inter_token_latency_seconds", "Time between the tokens of a reply", &g_metrics->itl);
+  // Swap it in whole, so a scraper never sees half a file
+  if (fclose(f) || rename(tmp, g_metrics_path)) perror("GPT2_METRICS");
+}
+
+void* metrics_main(void* unused) {
+  while (1) {
+	sleep(g_metrics_interval);
+	metrics_write();
+  }
+  return NULL;
+}
+
+// Started before GPT2_SERVE forks, so the writer stays in the master
+void metrics_init() {
+  g_metrics_path = getenv("GPT2_METRICS");
+  if (!g_metrics_path || !*g_metrics_path) return;
+  char* interval = getenv("GPT2_METRICS_INTERVAL");
+  if (interval && atoi(interval) > 0) g_metrics_interval = atoi(interval);
+
+  void* shared = mmap(NULL, sizeof(metrics_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  pthread_t thread;
+  if (shared == MAP_FAILED) {
+	perror("GPT2_METRICS");
+	return;
+  }
+  g_metrics = shared;
+  if (pthread_create(&thread, NULL, metrics_main, NULL)) {
+	fprintf(stderr, "GPT2_METRICS: no writer thread, %s is not written\n", g_metrics_path);
+	return;
+  }
+  pthread_detach(thread);
+  fprintf(stderr, "GPT2_METRICS: writing %s every %d s\n", g_metrics_path, g_metrics_interval);
+}
+
 // Now for the main function that does most of the useful work.
+/////////////////////////////////////////////////////////////
+///////////////INFERENCE FUNCTION INLINED////////////////////
+/////////////////////////////////////////////////////////////
+
+// Chat with one human: their lines come from in, the replies go to out.
+// history_tokens starts out holding the prompt (num_total_tokens of them),
+// and the chat's keys and values start out as a fork of base (if not NULL).
+void chat(FILE* in, FILE* out, int* history_tokens, Matrix* weights, Matrix wpe, Matrix wte, const kv_seq_t* base) {
+  int tmp, last_newline = 0;
+  sampler_t sampler = sampler_for_chat();
+  kv_seq_t seq = {0};
+  if (base) kv_seq_fork(&seq, base);
+  LOOP(i, num_total_tokens) {
+    if (history_tokens[i] == 18861) {
+      last_newline = i+1;
+    }
+  }
+
+  fprintf(out, "AI");
+  // Print out the prompt
+  LOOP(i, num_total_tokens-last_newline) {
+	fprintf(out, "%s", bpe+history_tokens[i+last_newline]*999);
+  }
+
+  while (1) {
+	char buf[1000] = {0};
+	strcat(buf, "\nAlice: ");
+	fprintf(out, "\n%s: ", bpe+20490*999);
+	fflush(out);
+	
+	// A client hanging up ends its chat (the terminal one goes on as it always has)
+	if (!fgets(buf+8, sizeof(buf)-8, in) && in != stdin) {
+	  kv_seq_release(&seq);
+	  return;
+	}
+	fprintf(out, "AI:");
+
+	strcat(buf, "\nBob:");
+	double asked = now_seconds(), last = 0;
+	int before = num_total_tokens;
+	num_total_tokens = tokenize(buf, history_tokens+num_total_tokens, history_tokens + 1024)-history_tokens;
+	if (g_metrics) metrics_count(&g_metrics->prefill_tokens, num_total_tokens - before);
+  
+	memory_top = memory;
+
+	// Loop forever in conversation, to iterate between the human and ml model
+	while (1) {
+	  // Reset the memory to the top of the original value
+	  memory = memory_top;
+
+	  // Run the whole model, on the device if we can, and pick the next token.
+	  // The device hands back just the candidates when there are few enough.
+	  double span = trace_begin();
+	  topk_t top;
+	  int k = sampler_candidates(&sampler);
+	  float* logits = k ? NULL : NewMatrix(1, 5e4, 0).dat;
+	  if (g_cl_pipeline_ready && cl_pipeline_forward(history_tokens, num_total_tokens, wpe, wte, k, &top, logits) == CL_SUCCESS) {
+		tmp = k ? sample_top(&sampler, &top) : sample(&sampler, logits, 5e4);
+	  } else {
+		Matrix hidden = forward_hidden(weights, wpe, wte, history_tokens, &seq);
+		if (!hidden.dat) tmp = -1;
+		else if (g_mips.probes && sampler.temperature <= 0) tmp = mips_argmax(hidden, wte);
+		else if (k && cl_logits_topk(hidden, wte, k, &top) == CL_SUCCESS) tmp = sample_top(&sampler, &top);
+		else tmp = sample(&sampler, logits_of(hidden, wte).dat, 5e4);
+	  }
+	  // Out of key/value blocks: this chat ends, the others go on
+	  if (tmp < 0) {
+		fprintf(out, "\n");
+		fflush(out);
+		return;
+	  }
+
+	  trace_end("token", num_total_tokens, span);
+	  trace_flush();
+	  if (g_metrics) {
+		double now = now_seconds();
+		hist_add(last ? &g_metrics->itl : &g_metrics->ttft, now - (last ? last : asked));
+		metrics_count(&g_metrics->decode_tokens, 1);
+		last = now;
+	  }
+
+	  // If the history is too long, then purge by half
+	  if (num_total_tokens == zz) {
+		memcpy(history_tokens, history_tokens+zz/2, tmp*2);
+		num_total_tokens -= zz/2;
+	  }
+	  // Write it to the history buffer
+	  history_tokens[num_total_tokens++] = tmp;
+
+	  // If it's a newline this is the end of the converstaion
+	  if (bpe[tmp*999] == 10) {
+		if (g_metrics) metrics_count(&g_metrics->requests, 1);
+		break;
+	  }
+
+	  // Otherwise print it and keep generating along
+	  fprintf(out, "%s", bpe+tmp*999);
+	  // or stop, if nobody is listening any more
+	  if (fflush(out)) {
+		kv_seq_release(&seq);
+		return;
+	  }
+	}
+
+  }
+
+}
+
+// Prefork chat server. With GPT2_SERVE=port the process that loaded the
+// weights and the BPE table listens on 127.0.0.1:port and forks
+// GPT2_WORKERS (default 4) workers, which take turns accepting connections
+// and hold one chat per connection, each starting from the prompt. The
+// workers share the weights and the table with the master copy-on-write
+// (nothing ever writes to them), so each one only costs its activations,
+// and a new worker starts at once. Workers that die are replaced.
+void serve_worker(int fd, int* prompt, int n, Matrix* weights, Matrix wpe, Matrix wte) {
+  // An OpenCL context does not survive fork(); the workers use the host path
+  memset(&g_cl_matmul, 0, sizeof(g_cl_matmul));
+  g_cl_pipeline_ready = 0;
+  signal(SIGPIPE, SIG_IGN);
+  stages_init(weights);
+
+  // Run the prompt through once; every chat forks its keys and values
+  void* top = memory;
+  kv_seq_t base = {0};
+  num_total_tokens = n;
+  forward(weights, wpe, wte, prompt, &base);
+  while (1) {
+	int conn = accept(fd, NULL, NULL);
+	if (conn < 0) continue;
+	FILE *in = fdopen(conn, "r"), *out = fdopen(dup(conn), "w");
+	if (in && out) {
+	  int history_tokens[1024];
+	  memcpy(history_tokens, prompt, n * sizeof(int));
+	  num_total_tokens = n;
+	  memory = top;
+	  chat(in, out, history_tokens, weights, wpe, wte, &base);
+	}
+	if (in) fclose(in); else close(conn);
+	if (out) fclose(out);
+  }
+}
+
+int serve(int* prompt, int n, Matrix* weights, Matrix wpe, Matrix wte) {
+  char* workers_env = getenv("GPT2_WORKERS");
+  int port = atoi(getenv("GPT2_SERVE")), workers = workers_env ? atoi(workers_env) : 4, one = 1;
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in addr = {0};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (fd < 0 || setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) ||
+	  bind(fd, (struct sockaddr*)&addr, sizeof(addr)) || listen(fd, 64)) {
+	perror("GPT2_SERVE");
+	return 1;
+  }
+  if (g_cl_matmul.kernels[0] || g_cl_pipeline_ready) {
+	fprintf(stderr, "GPT2_SERVE: the workers run on the CPU, OpenCL is not used\n");
+  }
+  fprintf(stderr, "GPT2_SERVE: %d workers on 127.0.0.1:%d\n", workers, port);
+
+  // Keep `workers` of them running
+  int running = 0;
+  while (1) {
+	for (; running < workers; running++) {
+	  pid_t pid = fork();
+	  if (pid < 0) {
+		perror("GPT2_SERVE: fork");
+		return 1;
+	  }
+	  if (!pid) {
+		serve_worker(fd, prompt, n, weights, wpe, wte);
+		_exit(0);
+	  }
+	}
+	// Only a worker that exited is replaced; a signal just interrupts the wait
+	if (wait(NULL) > 0) running--;
+	else if (errno == ECHILD) running = 0;
+  }
+}
+
 int main(int tmp, char** argv) {
-  if (tmp < 5) return 1;
+  // "./a.out --tune <model>" writes the OpenCL tuning profile and exits
+  int tune = tmp == 3 && !strcmp(argv[1], "--tune");
+  if (tmp < 5 && !tune) return 1;
+  argv += tune;
   // Initially let's figure out the right hyperparameters for this model
   // argv[1] stores the name of the model we're loading
   // tmp will map 124M -> 0, 355M -> 1, 775M -> 2, 1558M -> 3
@@ -367,13 +3844,25 @@ int main(int tmp, char** argv) {
   DIM = NHEAD*64;
   NLAYER = 12*tmp+12;
 
+  char* exact = getenv("GPT2_EXACT_MATH");
+  g_exact_math = exact && atoi(exact);
+  sampler_init();
+  trace_init();
+  char* prefill = getenv("GPT2_PREFILL_CHUNK");
+  if (prefill) g_prefill_chunk = atoi(prefill) > 0 ? atoi(prefill) : 0;
+
   init_opencl();
   atexit(shutdown_opencl);
+  if (tune) return cl_tune_run();
+
+  numa_init();
+  kv_init();
 
   // Allocate space
   zz = atoi(argv[4]);
   size_t activation_bytes = (size_t)2 * (size_t)DIM * (size_t)DIM * (size_t)NLAYER * (size_t)zz;
-  memory = malloc(activation_bytes);
+  // Page aligned, so matrices can be handed to a zero copy device in place
+  memory = alloc_arena(activation_bytes);
   if (!memory) {
 	fprintf(stderr, "OOM: failed to allocate %zu bytes for activation memory (zz=%d)\n", activation_bytes, zz);
 	return 1;
@@ -424,31 +3913,20 @@ int main(int tmp, char** argv) {
   // The initial prompt comes from argv[3]
   num_total_tokens = tokenize(argv[3], history_tokens, history_tokens + 1024) - history_tokens;
 
-  int last_newline = 0;
-  LOOP(i, num_total_tokens) {
-    if (history_tokens[i] == 18861) {
-      last_newline = i+1;
-    }
-  }
-
-  printf("AI");
-  // Print out the prompt
-  LOOP(i, num_total_tokens-last_newline) {
-	printf("%s", bpe+history_tokens[i+last_newline]*999);
-  }
-
   fp = fopen(argv[1], "r");
 
   /////////////////////////////////////////////////////////////
   //////////////READ MATRIX FUNCTION INLINED///////////////////
   /////////////////////////////////////////////////////////////
+  void* weights_start = memory;
   Matrix weights[999];
   Matrix* out = weights;
+  int stream = getenv("GPT2_STREAM") && atoi(getenv("GPT2_STREAM")) > 0;
 
   LOOP(i, NLAYER) {
 	LOOP(j, 12) {
 	  // These two nasty expressions compute the shapes of the matricies on disk
-	  *out++ = read_matrix(DIM+DIM*(j?j^8?j^11?0:3:3:2), DIM*((j%8==3) + 3*(j%8==1)+(j==9)));
+	  *out++ = (stream ? skip_matrix : read_matrix)(DIM+DIM*(j?j^8?j^11?0:3:3:2), DIM*((j%8==3) + 3*(j%8==1)+(j==9)));
 	}
   }
 
@@ -457,137 +3935,40 @@ int main(int tmp, char** argv) {
   
   Matrix wpe = read_matrix(1024, DIM),
 	wte = transpose(read_matrix(5e4, DIM));
+  if (!fp || load_matrices()) {
+	fprintf(stderr, "failed to read %s\n", argv[1]);
+	return 1;
+  }
 
-  
-  /////////////////////////////////////////////////////////////
-  ///////////////INFERENCE FUNCTION INLINED////////////////////
-  /////////////////////////////////////////////////////////////
-
-  while (1) {
-	char buf[1000] = {0};
-	int T;
-	strcat(buf, "\nAlice: ");
-	printf("\n%s: ", bpe+20490*999);
-	fflush(stdout);
-	
-	fgets(buf+8, sizeof(buf)-8, stdin);
-	printf("AI:");
-
-	strcat(buf, "\nBob:");
-	num_total_tokens = tokenize(buf, history_tokens+num_total_tokens, history_tokens + 1024)-history_tokens;
-  
-	memory_top = memory;
-
-	token_processed_upto = 0;
-
-	// Loop forever in conversation, to iterate between the human and ml model
-	while (1) {
-	  // Reset the memory to the top of the original value
-	  memory = memory_top;
-
-	  // Compute the context window size as the next largest multiple of 32
-	  T = num_total_tokens + 32 - num_total_tokens%32;
-	  // If the number is 0 mod 32, then we need to recompute everything bottom up
-	  token_processed_upto *= !!(num_total_tokens%32);
-	  
-	  // This is the line we're going to process.
-	  Matrix line = NewMatrix(T, DIM, 1);
-
-	  // Start by loading the embedding weights and adding the position encoding.
-	  LOOP(i, num_total_tokens) {
-		LOOP(j, DIM) {
-		  line.dat[i*DIM+j] = wte.dat[history_tokens[i]*DIM + j] + wpe.dat[j*1024+i];
-		}
-	  }
-
-	  // Start the transformer neural network inference.
-	  LOOP(i, NLAYER) {
-
-		// The layers on disk are stored by sorting alphabetically,
-		// because tensorflow makes no sense. We need to convert this to
-		// the correct order. For example, if there are 12 layers, we would
-		// have them on disk in order: 0 1 10 11 2 3 4 5 6 7 8 9
-		// which means we permute by the inverse: 0 1 4 5 6 7 8 9 10 11 2 3
-		int permute;
-		tmp=0;
-		LOOP(j, 10) {
-		  if (j == i) {
-			permute = tmp;
-		  }
-		  tmp++;
-		  LOOP(k, 10*(j>0)) {
-			if (j*10+k < NLAYER && tmp++ && i == j*10+k) {
-			  permute = tmp;
-			}
-		  }
-		}
-
-		// This layer's weights are at this offset
-		layer_weights = weights + 12*permute;
-
-		// Compute the keys, queries, and values all at once with a big multiply
-		Matrix qkv = transpose(slice(Linear(LayerNorm(line, 4), 0), 0, T*3, DIM));
-
-		// Make space for the output of the computation
-		Matrix result = NewMatrix(DIM, T, 1);
-
-		LOOP(k, NHEAD) {
-		  // Split the qkv into each of the heads
-		  Matrix merge = transpose(slice(qkv, k*3, 64*T, 3)),
-			// perform the product of the queries and keys and then exponentiate
-			a = tril(matmul_t_fast(transpose(slice(merge, 0, 64, T)),
-								   transpose(slice(merge, T, 64, T))), T),
-			// finally multiply the softmax output (a/sum(a)) with the values matrix
-			out = transpose(matmul_t_fast(divide(a, sum(a)), slice(merge, T*2, 64, T)));
-		  // and copy the output to the proper location in the result matrix
-		  memcpy(result.dat+64*T*k, out.dat, 64*T*4);
-		}
-
-		// Residual connection
-		line = add(line,Linear(transpose(result), 2));
-
-		// Activation function and residual connection
-		line = add(line, Linear(GELU(Linear(LayerNorm(line, 6), 8), 0), 10));
-	  }
-
-	  // Reset layer weights so we can do the last layer norm
-	  layer_weights = weights;
-	  line = LayerNorm(line, 12*NLAYER);
-
-	  // And finally compute the output logits
-	  token_processed_upto = 0;
-	  int tmp = num_total_tokens;
-	  num_total_tokens = 1;
-	  Matrix result = matmul_t_fast(transpose(slice(line, tmp-1, DIM, 1)), wte);
-	  token_processed_upto = num_total_tokens = tmp;
-
-	  // Get the arg-max token
-	  tmp = 0;
-	  LOOP(i, 5e4) {
-		if (result.dat[i] > result.dat[tmp]) {
-		  tmp = i;
-		}
-	  }
-
-	  // If the history is too long, then purge by half
-	  if (num_total_tokens == zz) {
-		memcpy(history_tokens, history_tokens+zz/2, tmp*2);
-		num_total_tokens -= zz/2;
-		token_processed_upto = 0;
-	  }
-	  // Write it to the history buffer
-	  history_tokens[num_total_tokens++] = tmp;
-
-	  // If it's a newline this is the end of the converstaion
-	  if (bpe[tmp*999] == 10) {
-		break;
+  if (stream) {
+	// The device would need every layer; streaming runs on the host
+	if (g_cl_matmul.kernels[0]) {
+	  fprintf(stderr, "GPT2_STREAM: the layers run on the CPU, OpenCL is not used\n");
+	  memset(&g_cl_matmul, 0, sizeof(g_cl_matmul));
+	}
+	numa_place(weights_start, memory);
+	stream_init(weights);
+  } else {
+	// The weights are transposed views of the checkpoint. The OpenCL kernels
+	// want them dense (out x in), so with a device they are copied once here.
+	if (g_cl_matmul.kernels[0] || getenv("GPT2_CL_DEVICES")) {
+	  LOOP(i, out - weights) {
+		weights[i] = dense(weights[i]);
 	  }
-
-	  // Otherwise print it and keep generating along
-	  printf("%s", bpe+tmp*999);
-	  fflush(stdout);
 	}
 
+	numa_place(weights_start, memory);
+	cl_pipeline_init(weights, out - weights, wpe, wte);
+	cl_weights_init(weights, out - weights, wte);
+	split_init(weights[9]);
   }
 
+  mips_init(wte);
+  metrics_init();
+
+  // With GPT2_SERVE the chats come from the network instead
+  if (getenv("GPT2_SERVE")) return serve(history_tokens, num_total_tokens, weights, wpe, wte);
+
+  stages_init(weights);
+  chat(stdin, stdout, history_tokens, weights, wpe, wte, NULL);
 }
@@ -0,0 +1,19 @@
+#!/bin/bash
+# Компиляция теста быстрых exp / tanh (собирается вместе с c_chat_gpt_2.c)
+
+echo "Компиляция test_fast_math..."
+
+gcc -o test_fast_math test_fast_math.c \
+    -lOpenCL -lm -O3 -Wall -march=native
+
+if [ $? -eq 0 ]; then
+    echo "✓ Компиляция успешна!"
+    echo ""
+    echo "Запуск теста:"
+    echo "  ./test_fast_math"
+    echo ""
+    echo "Примечание: без -march=native проверяется скалярная версия"
+else
+    echo "✗ Ошибка компиляции"
+    exit 1
+fi
@@ -0,0 +1,19 @@
+#!/bin/bash
+# Компиляция теста ответвления кэша ключей и значений (собирается вместе с c_chat_gpt_2.c)
+
+echo "Компиляция test_kv_fork..."
+
+gcc -o test_kv_fork test_kv_fork.c \
+    -lOpenCL -lm -O3 -Wall -march=native
+
+if [ $? -eq 0 ]; then
+    echo "✓ Компиляция успешна!"
+    echo ""
+    echo "Запуск теста:"
+    echo "  ./test_kv_fork"
+    echo ""
+    echo "Примечание: GPT2_KV=fp16 или int8 проверяет сжатый кэш"
+else
+    echo "✗ Ошибка компиляции"
+    exit 1
+fi
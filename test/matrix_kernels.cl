@@ -65,3 +65,315 @@ __kernel void matmul_a_bt(__global const float *A,
     }
     C[((unsigned int)row) * N + (unsigned int)col] = sum;
 }
+
+// ═══════════════════════════════════════════════════════════════
+// Ядра для прохода GPT-2 целиком на устройстве (GPT2_CL_PIPELINE)
+// Все активации остаются в буферах устройства, на хост читаются только логиты
+// ═══════════════════════════════════════════════════════════════
+
+// Эмбеддинг токенов + позиционное кодирование
+// wte: [vocab][dim], wpe: [1024][dim]
+__kernel void embed_tokens(__global const float *wte,
+                           __global const float *wpe,
+                           __global const int *tokens,
+                           __global float *out,
+                           const unsigned int n,
+                           const unsigned int dim) {
+    int row = get_global_id(0);
+    int col = get_global_id(1);
+
+    if ((unsigned int)row >= n || (unsigned int)col >= dim) return;
+
+    out[row * dim + col] = wte[tokens[row] * dim + col] + wpe[row * dim + col];
+}
+
+// LayerNorm по строкам: один work-item на строку
+// Дисперсия делится на (cols - 1), как в CPU версии
+__kernel void layernorm_rows(__global const float *x,
+                             __global float *y,
+                             __global const float *bias,
+                             __global const float *gain,
+                             const unsigned int rows,
+                             const unsigned int cols) {
+    int row = get_global_id(0);
+    if ((unsigned int)row >= rows) return;
+
+    __global const float *src = x + row * cols;
+    __global float *dst = y + row * cols;
+
+    float mean = 0.0f;
+    for (unsigned int k = 0; k < cols; k++) mean += src[k];
+    mean /= (float)cols;
+
+    float var = 0.0f;
+    for (unsigned int k = 0; k < cols; k++) {
+        float d = src[k] - mean;
+        var += d * d;
+    }
+    float inv = 1.0f / sqrt(var / (float)(cols - 1) + 1e-5f);
+
+    for (unsigned int k = 0; k < cols; k++) {
+        dst[k] = (src[k] - mean) * inv * gain[k] + bias[k];
+    }
+}
+
+// Эпилог matmul: цепочка поэлементных операций над готовым элементом C[row][col],
+// в том же порядке, что epilogue_t на хосте: + bias[col], GELU (если gelu != 0),
+// + res[row][col] (res - матрица M x N, может совпадать с C), * scale (если scale != 0).
+// bias и res могут быть NULL
+float matmul_epilogue(float x,
+                      __global const float *bias,
+                      __global const float *res,
+                      const unsigned int gelu,
+                      const float scale,
+                      const unsigned int row,
+                      const unsigned int col,
+                      const unsigned int N) {
+    if (bias) x += bias[col];
+    if (gelu) x = x / 2 * (1 + tanh(0.7978845f * (x + 0.044715f * x * x * x)));
+    if (res) x += res[row * N + col];
+    if (scale != 0.0f) x *= scale;
+    return x;
+}
+
+// C = A * B_T^T + bias (Linear слой), bias длины N добавляется к каждой строке
+// bias может быть NULL (обычное произведение, как matmul_a_bt);
+// res, gelu и scale - остальная часть эпилога (см. matmul_epilogue)
+__kernel void matmul_a_bt_bias(__global const float *A,
+                               __global const float *B_T,
+                               __global const float *bias,
+                               __global float *C,
+                               const unsigned int M,
+                               const unsigned int N,
+                               const unsigned int K,
+                               __global const float *res,
+                               const unsigned int gelu,
+                               const float scale) {
+    int row = get_global_id(0);
+    int col = get_global_id(1);
+
+    if ((unsigned int)row >= M || (unsigned int)col >= N) return;
+
+    float sum = 0.0f;
+    const unsigned int a_off = ((unsigned int)row) * K;
+    const unsigned int b_off = ((unsigned int)col) * K;
+    for (unsigned int k = 0; k < K; k++) {
+        sum += A[a_off + k] * B_T[b_off + k];
+    }
+    C[((unsigned int)row) * N + (unsigned int)col] = matmul_epilogue(sum, bias, res, gelu, scale, row, col, N);
+}
+
+// ═══════════════════════════════════════════════════════════════
+// Варианты matmul_a_bt_bias для автотюнера (./a.out --tune)
+// Аргументы те же (bias и res могут быть NULL); размер work-group задаёт хост
+// ═══════════════════════════════════════════════════════════════
+
+// Тайловый вариант: квадратная work-group TILE x TILE (TILE = get_local_size(0)),
+// тайлы A и B_T загружаются в локальную память (a_tile, b_tile по TILE*TILE float)
+__kernel void matmul_a_bt_tiled(__global const float *A,
+                                __global const float *B_T,
+                                __global const float *bias,
+                                __global float *C,
+                                const unsigned int M,
+                                const unsigned int N,
+                                const unsigned int K,
+                                __global const float *res,
+                                const unsigned int gelu,
+                                const float scale,
+                                __local float *a_tile,
+                                __local float *b_tile) {
+    const unsigned int tile = get_local_size(0);
+    const unsigned int lr = get_local_id(0);
+    const unsigned int lc = get_local_id(1);
+    const unsigned int row = get_global_id(0);
+    const unsigned int col = get_global_id(1);
+    const unsigned int b_row = get_group_id(1) * tile + lr;
+
+    float sum = 0.0f;
+    for (unsigned int k0 = 0; k0 < K; k0 += tile) {
+        const unsigned int k = k0 + lc;
+        a_tile[lr * tile + lc] = (row < M && k < K) ? A[row * K + k] : 0.0f;
+        b_tile[lr * tile + lc] = (b_row < N && k < K) ? B_T[b_row * K + k] : 0.0f;
+        barrier(CLK_LOCAL_MEM_FENCE);
+
+        for (unsigned int t = 0; t < tile; t++) {
+            sum += a_tile[lr * tile + t] * b_tile[lc * tile + t];
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    if (row < M && col < N) C[row * N + col] = matmul_epilogue(sum, bias, res, gelu, scale, row, col, N);
+}
+
+// Вариант для декода (M = 1..несколько строк): work-group {1, L} считает один
+// элемент C, L work-item'ов делят сумму по K и сворачивают её в локальной памяти.
+// L - степень двойки, global = {M, N * L}
+__kernel void matmul_a_bt_reduce(__global const float *A,
+                                 __global const float *B_T,
+                                 __global const float *bias,
+                                 __global float *C,
+                                 const unsigned int M,
+                                 const unsigned int N,
+                                 const unsigned int K,
+                                 __global const float *res,
+                                 const unsigned int gelu,
+                                 const float scale,
+                                 __local float *partial) {
+    const unsigned int row = get_global_id(0);
+    const unsigned int col = get_group_id(1);
+    const unsigned int lid = get_local_id(1);
+    const unsigned int L = get_local_size(1);
+
+    float sum = 0.0f;
+    if (row < M && col < N) {
+        for (unsigned int k = lid; k < K; k += L) {
+            sum += A[row * K + k] * B_T[col * K + k];
+        }
+    }
+    partial[lid] = sum;
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for (unsigned int s = L / 2; s > 0; s >>= 1) {
+        if (lid < s) partial[lid] += partial[lid + s];
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    if (lid == 0 && row < M && col < N) C[row * N + col] = matmul_epilogue(partial[0], bias, res, gelu, scale, row, col, N);
+}
+
+// Та же цепочка, что и эпилог matmul, отдельным проходом на месте:
+// x - матрица n / cols x cols, один work-item на элемент
+__kernel void fused_elementwise(__global float *x,
+                                __global const float *bias,
+                                __global const float *res,
+                                const unsigned int n,
+                                const unsigned int cols,
+                                const unsigned int gelu,
+                                const float scale) {
+    int gid = get_global_id(0);
+    if ((unsigned int)gid >= n) return;
+
+    x[gid] = matmul_epilogue(x[gid], bias, res, gelu, scale, gid / cols, gid % cols, cols);
+}
+
+// Каузальное внимание: один work-item на (строка запроса, голова)
+// qkv: [n][3*dim] (Q | K | V), out: [n][dim], голова = 64 столбца
+// Softmax exp(q.k/8) считается онлайн, без матрицы T x T
+__kernel void attention_causal(__global const float *qkv,
+                               __global float *out,
+                               const unsigned int n,
+                               const unsigned int dim) {
+    int row = get_global_id(0);
+    int head = get_global_id(1);
+
+    if ((unsigned int)row >= n || (unsigned int)head >= dim / 64) return;
+
+    const unsigned int stride = 3 * dim;
+    __global const float *q = qkv + row * stride + head * 64;
+
+    float acc[64];
+    for (int d = 0; d < 64; d++) acc[d] = 0.0f;
+    float m = -INFINITY;
+    float l = 0.0f;
+
+    for (int j = 0; j <= row; j++) {
+        __global const float *k = qkv + j * stride + dim + head * 64;
+        __global const float *v = qkv + j * stride + 2 * dim + head * 64;
+
+        float s = 0.0f;
+        for (int d = 0; d < 64; d++) s += q[d] * k[d];
+        s /= 8.0f;
+
+        float m_new = fmax(m, s);
+        float scale = exp(m - m_new);
+        float e = exp(s - m_new);
+        l = l * scale + e;
+        for (int d = 0; d < 64; d++) acc[d] = acc[d] * scale + e * v[d];
+        m = m_new;
+    }
+
+    __global float *dst = out + row * dim + head * 64;
+    for (int d = 0; d < 64; d++) dst[d] = acc[d] / l;
+}
+
+// ═══════════════════════════════════════════════════════════════
+// Top-k логитов на устройстве: на хост читаются только k пар (id, логит)
+// ═══════════════════════════════════════════════════════════════
+
+// Должны совпадать с TOPK_MAX и TOPK_GROUP в c_chat_gpt_2.c
+#define TOPK_MAX 32
+#define TOPK_GROUP 64
+
+// (va, ia) лучше (vb, ib): больше значение, при равенстве меньший id
+// (так же выбирает argmax на хосте)
+#define TOPK_BETTER(va, ia, vb, ib) ((va) > (vb) || ((va) == (vb) && (ia) < (ib)))
+
+// Двухстадийная редукция. Каждый work-item набирает свои лучшие k из x[i]
+// (i с шагом global size) в отсортированный список, затем work-group
+// сливает списки попарно деревом в локальной памяти, и work-item 0 пишет
+// лучшие k группы в out_vals/out_ids[группа * k ..].
+// Стадия 1: ids = NULL (id = индекс), TOPK_GROUPS групп по всем логитам.
+// Стадия 2: одна группа по k * TOPK_GROUPS результатам стадии 1.
+// Размер work-group - TOPK_GROUP, lv и li по TOPK_GROUP * TOPK_MAX элементов
+__kernel void topk(__global const float *x,
+                   __global const int *ids,
+                   const unsigned int n,
+                   const unsigned int k,
+                   __global float *out_vals,
+                   __global int *out_ids,
+                   __local float *lv,
+                   __local int *li) {
+    int lid = get_local_id(0);
+    float v[TOPK_MAX];
+    int id[TOPK_MAX];
+    for (unsigned int j = 0; j < k; j++) {
+        v[j] = -INFINITY;
+        id[j] = INT_MAX;
+    }
+
+    for (unsigned int i = get_global_id(0); i < n; i += get_global_size(0)) {
+        float xv = x[i];
+        int xi = ids ? ids[i] : (int)i;
+        int j = k - 1;
+        if (!TOPK_BETTER(xv, xi, v[j], id[j])) continue;
+        for (; j > 0 && TOPK_BETTER(xv, xi, v[j - 1], id[j - 1]); j--) {
+            v[j] = v[j - 1];
+            id[j] = id[j - 1];
+        }
+        v[j] = xv;
+        id[j] = xi;
+    }
+    for (unsigned int j = 0; j < k; j++) {
+        lv[lid * k + j] = v[j];
+        li[lid * k + j] = id[j];
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    // Слияние двух отсортированных списков (своего и lid + s) в лучшие k
+    for (int s = get_local_size(0) / 2; s > 0; s >>= 1) {
+        if (lid < s) {
+            int a = lid * k, b = (lid + s) * k, ea = a + k, eb = b + k;
+            for (unsigned int j = 0; j < k; j++) {
+                if (b >= eb || (a < ea && TOPK_BETTER(lv[a], li[a], lv[b], li[b]))) {
+                    v[j] = lv[a];
+                    id[j] = li[a++];
+                } else {
+                    v[j] = lv[b];
+                    id[j] = li[b++];
+                }
+            }
+            for (unsigned int j = 0; j < k; j++) {
+                lv[lid * k + j] = v[j];
+                li[lid * k + j] = id[j];
+            }
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    if (lid == 0) {
+        for (unsigned int j = 0; j < k; j++) {
+            out_vals[get_group_id(0) * k + j] = lv[j];
+            out_ids[get_group_id(0) * k + j] = li[j];
+        }
+    }
+}
@@ -15,6 +15,8 @@ typedef struct {
     cl_uint compute_units;
     cl_ulong global_mem_size;
     cl_uint max_clock_freq;
+    cl_bool host_unified_memory;   // память общая с хостом (APU, CPU-устройства)
+    cl_uint mem_base_addr_align;   // выравнивание буферов, в битах
 } gpu_device_info_t;
 
 // Вывод информации об устройстве
@@ -26,10 +28,36 @@ void print_device_info(const gpu_device_info_t *info) {
     printf("Устройство:     %s\n", info->device_name);
     printf("Вычисл. блоки:  %u CUs\n", info->compute_units);
     printf("Память:         %lu MB\n", info->global_mem_size / (1024 * 1024));
+    printf("Общая память:   %s\n", info->host_unified_memory ? "да (zero-copy)" : "нет");
     printf("Частота:        %u MHz\n", info->max_clock_freq);
     printf("═══════════════════════════════════════════════════════════════\n");
 }
 
+// Заполнить информацию об устройстве
+void fill_device_info(gpu_device_info_t *info, cl_platform_id platform, cl_device_id device) {
+    info->platform = platform;
+    info->device = device;
+    
+    clGetPlatformInfo(platform, CL_PLATFORM_NAME, 
+                      sizeof(info->platform_name), info->platform_name, NULL);
+    clGetDeviceInfo(device, CL_DEVICE_NAME, 
+                    sizeof(info->device_name), info->device_name, NULL);
+    clGetDeviceInfo(device, CL_DEVICE_MAX_COMPUTE_UNITS, 
+                    sizeof(info->compute_units), &info->compute_units, NULL);
+    clGetDeviceInfo(device, CL_DEVICE_GLOBAL_MEM_SIZE, 
+                    sizeof(info->global_mem_size), &info->global_mem_size, NULL);
+    clGetDeviceInfo(device, CL_DEVICE_MAX_CLOCK_FREQUENCY, 
+                    sizeof(info->max_clock_freq), &info->max_clock_freq, NULL);
+    
+    // Для zero-copy буферов (CL_MEM_USE_HOST_PTR)
+    info->host_unified_memory = CL_FALSE;
+    info->mem_base_addr_align = 0;
+    clGetDeviceInfo(device, CL_DEVICE_HOST_UNIFIED_MEMORY, 
+                    sizeof(info->host_unified_memory), &info->host_unified_memory, NULL);
+    clGetDeviceInfo(device, CL_DEVICE_MEM_BASE_ADDR_ALIGN, 
+                    sizeof(info->mem_base_addr_align), &info->mem_base_addr_align, NULL);
+}
+
 // Главная функция для выбора лучшего GPU устройства
 // Возвращает 0 при успехе, -1 при ошибке
 int select_best_gpu_device(gpu_device_info_t *info) {
@@ -102,23 +130,78 @@ int select_best_gpu_device(gpu_device_info_t *info) {
     }
     
     // Шаг 4: Заполнить информацию об устройстве
-    info->platform = best_platform;
-    info->device = best_device;
-    
-    clGetPlatformInfo(best_platform, CL_PLATFORM_NAME, 
-                      sizeof(info->platform_name), info->platform_name, NULL);
-    clGetDeviceInfo(best_device, CL_DEVICE_NAME, 
-                    sizeof(info->device_name), info->device_name, NULL);
-    clGetDeviceInfo(best_device, CL_DEVICE_MAX_COMPUTE_UNITS, 
-                    sizeof(info->compute_units), &info->compute_units, NULL);
-    clGetDeviceInfo(best_device, CL_DEVICE_GLOBAL_MEM_SIZE, 
-                    sizeof(info->global_mem_size), &info->global_mem_size, NULL);
-    clGetDeviceInfo(best_device, CL_DEVICE_MAX_CLOCK_FREQUENCY, 
-                    sizeof(info->max_clock_freq), &info->max_clock_freq, NULL);
+    fill_device_info(info, best_platform, best_device);
     
     return 0;
 }
 
+// Выбрать ВСЕ устройства заданного типа на всех платформах
+// (CL_DEVICE_TYPE_GPU, CL_DEVICE_TYPE_ALL, ...)
+// Возвращает количество найденных устройств (не больше max_devices)
+int select_all_devices(cl_device_type type, gpu_device_info_t *infos, int max_devices) {
+    cl_uint num_platforms;
+    if (clGetPlatformIDs(0, NULL, &num_platforms) != CL_SUCCESS || num_platforms == 0) {
+        return 0;
+    }
+    
+    cl_platform_id *platforms = (cl_platform_id*)malloc(sizeof(cl_platform_id) * num_platforms);
+    clGetPlatformIDs(num_platforms, platforms, NULL);
+    
+    int count = 0;
+    for (cl_uint i = 0; i < num_platforms && count < max_devices; i++) {
+        cl_uint num_devices;
+        if (clGetDeviceIDs(platforms[i], type, 0, NULL, &num_devices) != CL_SUCCESS || num_devices == 0) {
+            continue;
+        }
+        
+        cl_device_id *devices = (cl_device_id*)malloc(sizeof(cl_device_id) * num_devices);
+        clGetDeviceIDs(platforms[i], type, num_devices, devices, NULL);
+        for (cl_uint j = 0; j < num_devices && count < max_devices; j++) {
+            fill_device_info(&infos[count++], platforms[i], devices[j]);
+        }
+        free(devices);
+    }
+    
+    free(platforms);
+    return count;
+}
+
+// Разбить устройство на count равных под-устройств через clCreateSubDevices
+// Удобно для проверки multi-device кода на одном CPU (например, pocl)
+// Возвращает количество созданных под-устройств, 0 при ошибке
+int create_sub_devices(const gpu_device_info_t *info, int count, gpu_device_info_t *subs) {
+    cl_uint units = info->compute_units / count;
+    if (units == 0) {
+        fprintf(stderr, "ОШИБКА: %u вычисл. блоков не делятся на %d под-устройств\n",
+                info->compute_units, count);
+        return 0;
+    }
+    
+    cl_device_partition_property props[] = {
+        CL_DEVICE_PARTITION_EQUALLY, (cl_device_partition_property)units, 0
+    };
+    
+    cl_uint num_subs = 0;
+    cl_device_id *devices = (cl_device_id*)malloc(sizeof(cl_device_id) * info->compute_units);
+    cl_int err = clCreateSubDevices(info->device, props, info->compute_units, devices, &num_subs);
+    if (err != CL_SUCCESS) {
+        fprintf(stderr, "ОШИБКА: clCreateSubDevices failed (err=%d)\n", err);
+        free(devices);
+        return 0;
+    }
+    
+    // Лишние под-устройства (если блоки делятся с остатком) не нужны
+    for (cl_uint i = 0; i < num_subs; i++) {
+        if ((int)i < count) {
+            fill_device_info(&subs[i], info->platform, devices[i]);
+        } else {
+            clReleaseDevice(devices[i]);
+        }
+    }
+    free(devices);
+    return (int)num_subs < count ? (int)num_subs : count;
+}
+
 // Создать контекст для выбранного устройства
 cl_context create_gpu_context(const gpu_device_info_t *info, cl_int *err_code) {
     cl_context_properties props[] = {
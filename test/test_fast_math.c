@@ -0,0 +1,143 @@
+// Тест быстрых exp / tanh / rsqrt (exp_array, tanh_array, rsqrt_array в c_chat_gpt_2.c):
+// 1. максимальная ошибка в ulp относительно libm (double) на всём рабочем диапазоне
+// 2. насколько сдвигаются логиты целой модели (случайные веса, 2 слоя) по сравнению
+//    с GPT2_EXACT_MATH=1
+#define main gpt2_main
+#include "../c_chat_gpt_2.c"
+#undef main
+
+// Допуски (см. комментарий к exp_array в c_chat_gpt_2.c)
+#define EXP_MAX_ULP 1.5
+#define TANH_MAX_ULP 2.0
+#define RSQRT_MAX_ULP 4.5
+#define LOGIT_MAX_REL 1e-4
+
+// Ошибка y в ulp числа ref (ref - точное значение в double)
+double ulp_error(float y, double ref) {
+    float r = fabsf((float)ref);
+    double ulp = (double)nextafterf(r, INFINITY) - r;
+    return fabs(y - ref) / ulp;
+}
+
+double rsqrt_ref(double x) {
+    return 1 / sqrt(x);
+}
+
+// Перебор float из [lo, hi] (каждое step-е битовое представление, только нормальные числа)
+// через fn пачками по 4096; возвращает максимальную ошибку в ulp и аргумент, где она достигнута
+double max_ulp(void (*fn)(float*, int, float), double (*ref)(double), float lo, float hi,
+               unsigned step, float *worst) {
+    float x[4096], y[4096];
+    int n = 0;
+    double max_err = 0;
+
+    for (int sign = 0; sign < 2; sign++) {
+        float bound = sign ? -lo : hi;
+        if (bound <= 0) continue;
+        unsigned last;
+        memcpy(&last, &bound, 4);
+        for (unsigned bits = 0x00800000; bits <= last; bits += step) {
+            memcpy(&x[n], &bits, 4);
+            if (sign) x[n] = -x[n];
+            if (++n < 4096 && bits + step <= last) continue;
+
+            memcpy(y, x, n * sizeof(float));
+            fn(y, n, 1);
+            for (int i = 0; i < n; i++) {
+                double err = ulp_error(y[i], ref(x[i]));
+                if (err > max_err) {
+                    max_err = err;
+                    *worst = x[i];
+                }
+            }
+            n = 0;
+        }
+    }
+    return max_err;
+}
+
+// Случайное число в [-1, 1)
+float frand() {
+    return rand() / (RAND_MAX + 1.0f) * 2 - 1;
+}
+
+int main() {
+    int failed = 0;
+    float worst = 0;
+
+    printf("Векторная ширина: %d float\n", VW);
+
+    double err = max_ulp(exp_array, exp, -87, 88, 7, &worst);
+    printf("exp:  макс. ошибка %.3f ulp (x = %g), допуск %.1f\n", err, worst, EXP_MAX_ULP);
+    failed |= err > EXP_MAX_ULP;
+
+    err = max_ulp(tanh_array, tanh, -10, 10, 7, &worst);
+    printf("tanh: макс. ошибка %.3f ulp (x = %g), допуск %.1f\n", err, worst, TANH_MAX_ULP);
+    failed |= err > TANH_MAX_ULP;
+
+    err = max_ulp(rsqrt_array, rsqrt_ref, 1e-6, 1e6, 7, &worst);
+    printf("rsqrt: макс. ошибка %.3f ulp (x = %g), допуск %.1f\n", err, worst, RSQRT_MAX_ULP);
+    failed |= err > RSQRT_MAX_ULP;
+
+    // Маленькая модель: 2 слоя, 2 головы, DIM = 128, веса случайные, читаются
+    // из временного файла тем же кодом, что и в main() программы
+    NHEAD = 2;
+    DIM = NHEAD * 64;
+    NLAYER = 2;
+    kv_init();
+    memory = aligned_alloc(4096, (size_t)1 << 28);
+    fp = tmpfile();
+    srand(1);
+    for (int i = 0; i < 8 << 20; i++) {
+        float w = frand() * 0.3f;
+        fwrite(&w, sizeof(float), 1, fp);
+    }
+    rewind(fp);
+
+    Matrix weights[999];
+    Matrix *out = weights;
+    LOOP(i, NLAYER) {
+        LOOP(j, 12) {
+            *out++ = read_matrix(DIM+DIM*(j?j^8?j^11?0:3:3:2), DIM*((j%8==3) + 3*(j%8==1)+(j==9)));
+        }
+    }
+    *out++ = read_matrix(DIM, 1);
+    *out++ = read_matrix(DIM, 1);
+    Matrix wpe = read_matrix(1024, DIM), wte = transpose(read_matrix(5e4, DIM));
+    if (load_matrices()) {
+        printf("✗ Не удалось прочитать веса\n");
+        return 1;
+    }
+    memory_top = memory;
+
+    int tokens[64];
+    LOOP(i, 64) tokens[i] = rand() % 50000;
+    num_total_tokens = 40;
+
+    static float exact[50000];
+    double max_diff = 0, max_logit = 0;
+    int argmax[2] = {0, 0};
+    LOOP(mode, 2) {
+        g_exact_math = !mode;
+        memory = memory_top;
+        // Каждый режим считает все токены заново, со своим кэшем ключей и значений
+        kv_seq_t seq = {0};
+        Matrix logits = forward(weights, wpe, wte, tokens, &seq);
+        LOOP(i, 50000) {
+            if (logits.dat[i] > logits.dat[argmax[mode]]) argmax[mode] = i;
+            if (!mode) {
+                exact[i] = logits.dat[i];
+                if (fabs(exact[i]) > max_logit) max_logit = fabs(exact[i]);
+            } else if (fabs(logits.dat[i] - exact[i]) > max_diff) {
+                max_diff = fabs(logits.dat[i] - exact[i]);
+            }
+        }
+        kv_seq_release(&seq);
+    }
+    printf("логиты: макс. отклонение %.3g (%.3g от макс. |логита| %.3g), допуск %.0e, argmax %d / %d\n",
+           max_diff, max_diff / max_logit, max_logit, LOGIT_MAX_REL, argmax[0], argmax[1]);
+    failed |= max_diff > LOGIT_MAX_REL * max_logit || argmax[0] != argmax[1];
+
+    printf(failed ? "✗ Тест не пройден\n" : "✓ Все проверки пройдены\n");
+    return failed;
+}
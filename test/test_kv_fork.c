@@ -0,0 +1,120 @@
+// Тест кэша ключей и значений (kv_seq_fork / kv_seq_prepare в c_chat_gpt_2.c):
+// последовательность, ответвлённая от другой, должна давать те же логиты, что и
+// посчитанная заново, и после того как обе допишут свои токены в общий блок
+// (копирование при записи), и ни одна не должна испортить блоки другой
+#define main gpt2_main
+#include "../c_chat_gpt_2.c"
+#undef main
+
+// Допуск: заново считаются все строки сразу, из кэша - только новые,
+// поэтому суммы могут складываться в другом порядке
+#define LOGIT_MAX_REL 1e-4
+
+Matrix weights[999], wpe, wte;
+int failed;
+
+// Случайное число в [-1, 1)
+float frand() {
+    return rand() / (RAND_MAX + 1.0f) * 2 - 1;
+}
+
+// Логиты последнего из n токенов, посчитанные через seq, в out
+void logits(kv_seq_t* seq, int* tokens, int n, float* out) {
+    memory = memory_top;
+    num_total_tokens = n;
+    Matrix l = forward(weights, wpe, wte, tokens, seq);
+    if (!l.dat) {
+        printf("✗ Не хватило блоков кэша\n");
+        exit(1);
+    }
+    memcpy(out, l.dat, 50000 * sizeof(float));
+}
+
+// Сравнить логиты seq (уже с кэшем) с логитами новой последовательности
+void check(const char* name, kv_seq_t* seq, int* tokens, int n) {
+    static float cached[50000], fresh[50000];
+    logits(seq, tokens, n, cached);
+    kv_seq_t scratch = {0};
+    logits(&scratch, tokens, n, fresh);
+    kv_seq_release(&scratch);
+
+    double max_diff = 0, max_logit = 0;
+    int argmax[2] = {0, 0};
+    LOOP(i, 50000) {
+        if (cached[i] > cached[argmax[0]]) argmax[0] = i;
+        if (fresh[i] > fresh[argmax[1]]) argmax[1] = i;
+        if (fabs(fresh[i]) > max_logit) max_logit = fabs(fresh[i]);
+        if (fabs(cached[i] - fresh[i]) > max_diff) max_diff = fabs(cached[i] - fresh[i]);
+    }
+    int bad = max_diff > LOGIT_MAX_REL * max_logit || argmax[0] != argmax[1];
+    printf("%s %s: %d токенов, макс. отклонение %.3g (макс. |логит| %.3g), argmax %d / %d\n",
+           bad ? "✗" : "✓", name, n, max_diff, max_logit, argmax[0], argmax[1]);
+    failed |= bad;
+}
+
+int main() {
+    // Маленькая модель: 2 слоя, 2 головы, DIM = 128, веса случайные, читаются
+    // из временного файла тем же кодом, что и в main() программы
+    NHEAD = 2;
+    DIM = NHEAD * 64;
+    NLAYER = 2;
+    kv_init();
+    memory = aligned_alloc(4096, (size_t)1 << 28);
+    fp = tmpfile();
+    srand(1);
+    for (int i = 0; i < 8 << 20; i++) {
+        float w = frand() * 0.3f;
+        fwrite(&w, sizeof(float), 1, fp);
+    }
+    rewind(fp);
+
+    Matrix *out = weights;
+    LOOP(i, NLAYER) {
+        LOOP(j, 12) {
+            *out++ = read_matrix(DIM+DIM*(j?j^8?j^11?0:3:3:2), DIM*((j%8==3) + 3*(j%8==1)+(j==9)));
+        }
+    }
+    *out++ = read_matrix(DIM, 1);
+    *out++ = read_matrix(DIM, 1);
+    wpe = read_matrix(1024, DIM);
+    wte = transpose(read_matrix(5e4, DIM));
+    if (load_matrices()) {
+        printf("✗ Не удалось прочитать веса\n");
+        return 1;
+    }
+    memory_top = memory;
+
+    // Общее начало из 40 токенов (второй блок заполнен не до конца) и два
+    // разных продолжения
+    int a[64], b[64];
+    LOOP(i, 64) a[i] = b[i] = rand() % 50000;
+    for (int i = 40; i < 64; i++) b[i] = rand() % 50000;
+
+    kv_seq_t base = {0}, fork = {0}, same = {0};
+    float scratch[50000];
+    logits(&base, a, 40, scratch);
+
+    // Ответвление без новых токенов: последний токен считается заново
+    kv_seq_fork(&same, &base);
+    check("ответвление той же длины", &same, a, 40);
+
+    // Ответвление дописывает во второй блок, который делит с base
+    kv_seq_fork(&fork, &base);
+    check("ответвление с продолжением", &fork, b, 50);
+
+    // base дописывает своё продолжение туда же и не видит токенов fork
+    check("исходная после ответвления", &base, a, 60);
+    // и наоборот
+    check("ответвление после исходной", &fork, b, 64);
+
+    kv_seq_release(&same);
+    kv_seq_release(&fork);
+    kv_seq_release(&base);
+    // Все блоки вернулись в пул
+    int leaked = g_kv_num_blocks - g_kv_num_free;
+    printf("%s занято блоков после освобождения: %d из %d\n", leaked ? "✗" : "✓", leaked, g_kv_num_blocks);
+    failed |= leaked != 0;
+
+    printf(failed ? "✗ Тест не пройден\n" : "✓ Все проверки пройдены\n");
+    return failed;
+}